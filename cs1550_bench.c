@@ -0,0 +1,574 @@
+/*
+	Benchmark for the cs1550 storage engine. Calls the API in
+	cs1550_engine.h directly against a scratch image, so no kernel mount or
+	FUSE round trips are involved, and reports ops/s, MB/s and latency
+	percentiles for each workload.
+
+	make cs1550_bench
+
+	./cs1550_bench [-w workloads] [-t threads] [-s disk MB] [-f file MB]
+		[-b io bytes] [-n ops] [-c cache KB] [-B block size] [-m] [-z] [-D] [-C] [-d dir]
+*/
+
+#include "cs1550_engine.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+//Directory holding the data files of the other workloads
+#define BENCH_DIR "bench"
+
+//Most operations -n can ask for. The create workload names its files f and
+//an index below nOps, and its directories c and seven digits, and those have
+//to fit in the 8 characters of an 8.3 name.
+#define MAX_OPS 10000000
+
+//Settings from the command line
+struct bench_config
+{
+	const char *workloads;		//-w, comma separated names from the workloads table or "all"
+	int nThreads;			//-t, threads running each workload at once
+	long diskMB;			//-s, size of the scratch .disk
+	long fileMB;			//-f, size of each thread's file for the data workloads
+	long ioSize;			//-b, bytes per read or write
+	long nOps;			//-n, operations per thread for the random and metadata workloads
+	const char *dir;		//-d, where the scratch image goes, a new directory in /tmp if not given
+};
+
+typedef struct bench_config bench_config;
+
+//What one thread measured, its latencies in nanoseconds
+struct bench_result
+{
+	long *latencies;
+	long nOps;
+	long bytes;
+};
+
+typedef struct bench_result bench_result;
+
+//One thread's share of a workload
+struct bench_thread
+{
+	pthread_t thread;
+	int id;
+	void (*run)(struct bench_thread *);
+	bench_result result;
+	unsigned int seed;		//for rand_r
+};
+
+typedef struct bench_thread bench_thread;
+
+static bench_config config = { "all", 1, 64, 16, 65536, 10000, NULL };
+static cs1550_options options = CS1550_DEFAULT_OPTIONS;
+
+//Most files the engine puts in one directory
+static long filesPerDirectory;
+
+//Set once a workload has made the files the ones after it use
+static int filesWritten = 0;
+static int filesCreated = 0;
+
+// Nanoseconds on a clock that only goes forward
+static long now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Remembers how long one operation took
+static void record(bench_result *result, long start, long bytes)
+{
+	result->latencies[result->nOps++] = now() - start;
+	result->bytes += bytes;
+}
+
+// Path of a thread's data file
+static void dataPath(char *path, int id)
+{
+	sprintf(path, "/%s/t%d.dat", BENCH_DIR, id);
+}
+
+// Path of the i-th file a thread makes in the create workload. Every thread
+// gets its own directories, filesPerDirectory files each, so they don't
+// share one directory's lock.
+static void createPath(char *path, int id, long i)
+{
+	sprintf(path, "/c%07ld/f%ld.dat", (long)id * ((config.nOps + filesPerDirectory - 1) / filesPerDirectory)
+		+ i / filesPerDirectory, i % filesPerDirectory);
+}
+
+// Writes a thread's data file from start to end, one ioSize piece at a time
+static void seqWrite(bench_thread *thread)
+{
+	cs1550_file *file;
+	char path[64];
+	char *buf = malloc(config.ioSize);
+	long fileSize = config.fileMB * 1024 * 1024;
+	long offset;
+
+	if(buf == NULL)
+		return;
+	else;
+	memset(buf, 'a' + thread->id % 26, config.ioSize);
+	dataPath(path, thread->id);
+	cs1550_create(path);
+	if(cs1550_open_file(path, O_RDWR, &file) < 0)
+	{
+		free(buf);
+		return;
+	}
+	else;
+	for(offset = 0; offset < fileSize; offset += config.ioSize)
+	{
+		long start = now();
+		int res = cs1550_write_file(file, buf, config.ioSize, offset);
+		if(res <= 0)
+			break;
+		else;
+		record(&thread->result, start, res);
+	}
+	cs1550_close_file(file);
+	free(buf);
+}
+
+// Reads a thread's data file from start to end
+static void seqRead(bench_thread *thread)
+{
+	cs1550_file *file;
+	char path[64];
+	char *buf = malloc(config.ioSize);
+	long offset = 0;
+
+	dataPath(path, thread->id);
+	if(buf == NULL || cs1550_open_file(path, O_RDONLY, &file) < 0)
+	{
+		free(buf);
+		return;
+	}
+	else;
+	while(thread->result.nOps < config.fileMB * 1024 * 1024 / config.ioSize)
+	{
+		long start = now();
+		int res = cs1550_read_file(file, buf, config.ioSize, offset);
+		if(res <= 0)
+			break;
+		else;
+		record(&thread->result, start, res);
+		offset += res;
+	}
+	cs1550_close_file(file);
+	free(buf);
+}
+
+// Reads nOps pieces from random places in a thread's data file
+static void randRead(bench_thread *thread)
+{
+	cs1550_file *file;
+	char path[64];
+	char *buf = malloc(config.ioSize);
+	long pieces = config.fileMB * 1024 * 1024 / config.ioSize;
+	long i;
+
+	dataPath(path, thread->id);
+	if(buf == NULL || pieces == 0 || cs1550_open_file(path, O_RDONLY, &file) < 0)
+	{
+		free(buf);
+		return;
+	}
+	else;
+	for(i = 0; i < config.nOps; i++)
+	{
+		long offset = (rand_r(&thread->seed) % pieces) * config.ioSize;
+		long start = now();
+		int res = cs1550_read_file(file, buf, config.ioSize, offset);
+		if(res <= 0)
+			break;
+		else;
+		record(&thread->result, start, res);
+	}
+	cs1550_close_file(file);
+	free(buf);
+}
+
+// Creates nOps empty files, making directories for them as it goes
+static void createFiles(bench_thread *thread)
+{
+	char path[64];
+	long i;
+
+	for(i = 0; i < config.nOps; i++)
+	{
+		long start = now();
+		createPath(path, thread->id, i);
+		if(i % filesPerDirectory == 0)
+		{
+			*strrchr(path, '/') = '\0';
+			cs1550_make_directory(path);
+			createPath(path, thread->id, i);
+		}
+		else;
+		if(cs1550_create(path) < 0)
+			break;
+		else;
+		record(&thread->result, start, 0);
+	}
+}
+
+// Looks up nOps random files made by the create workload
+static void statFiles(bench_thread *thread)
+{
+	struct stat st;
+	char path[64];
+	long i;
+
+	for(i = 0; i < config.nOps; i++)
+	{
+		long start = now();
+		createPath(path, thread->id, rand_r(&thread->seed) % config.nOps);
+		if(cs1550_lookup(path, &st) < 0)
+			break;
+		else;
+		record(&thread->result, start, 0);
+	}
+}
+
+// Random reads, overwrites and lookups on a thread's data file, 7 to 2 to 1
+static void mixed(bench_thread *thread)
+{
+	cs1550_file *file;
+	struct stat st;
+	char path[64];
+	char *buf = malloc(config.ioSize);
+	long pieces = config.fileMB * 1024 * 1024 / config.ioSize;
+	long i;
+
+	if(buf == NULL)
+		return;
+	else;
+	memset(buf, 'm', config.ioSize);
+	dataPath(path, thread->id);
+	if(pieces == 0 || cs1550_open_file(path, O_RDWR, &file) < 0)
+	{
+		free(buf);
+		return;
+	}
+	else;
+	for(i = 0; i < config.nOps; i++)
+	{
+		int kind = rand_r(&thread->seed) % 10;
+		long offset = (rand_r(&thread->seed) % pieces) * config.ioSize;
+		long start = now();
+		int res;
+
+		if(kind < 7)
+			res = cs1550_read_file(file, buf, config.ioSize, offset);
+		else if(kind < 9)
+			res = cs1550_write_file(file, buf, config.ioSize, offset);
+		else
+			res = cs1550_lookup(path, &st) < 0 ? -1 : 0;
+		if(res < 0)
+			break;
+		else;
+		record(&thread->result, start, res);
+	}
+	cs1550_close_file(file);
+	free(buf);
+}
+
+//The workloads -w can pick from, in the order "all" runs them
+static struct
+{
+	const char *name;
+	void (*run)(bench_thread *);
+	long maxOps;			//most operations one thread can do, 0 for nOps
+	int *needs;			//flag that has to be set before it can run
+	int *makes;			//flag it sets
+} workloads[] = {
+	{ "seqwrite", seqWrite, -1, NULL, &filesWritten },
+	{ "seqread", seqRead, -1, &filesWritten, NULL },
+	{ "randread", randRead, 0, &filesWritten, NULL },
+	{ "create", createFiles, 0, NULL, &filesCreated },
+	{ "stat", statFiles, 0, &filesCreated, NULL },
+	{ "mixed", mixed, 0, &filesWritten, NULL },
+};
+
+#define N_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static void *runThread(void *arg)
+{
+	bench_thread *thread = arg;
+
+	thread->run(thread);
+	return NULL;
+}
+
+static int compareLongs(const void *a, const void *b)
+{
+	long x = *(const long *)a;
+	long y = *(const long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Latency at a percentile of a sorted array, in microseconds
+static double percentile(long *sorted, long n, double p)
+{
+	long i = (long)(p / 100.0 * (n - 1) + 0.5);
+
+	return n > 0 ? sorted[i] / 1000.0 : 0;
+}
+
+// Runs one workload on every thread at once and prints what it measured,
+// -ENOMEM if there isn't room for the latencies
+static int runWorkload(int w)
+{
+	bench_thread *threads = calloc(config.nThreads, sizeof(bench_thread));
+	long maxOps = workloads[w].maxOps < 0 ? config.fileMB * 1024 * 1024 / config.ioSize + 1 : config.nOps;
+	long *all = malloc((maxOps * config.nThreads + 1) * sizeof(long));
+	int ok = threads != NULL && all != NULL;
+	long nOps = 0;
+	long bytes = 0;
+	long start;
+	double seconds;
+	int i;
+
+	for(i = 0; ok && i < config.nThreads; i++)
+	{
+		threads[i].id = i;
+		threads[i].run = workloads[w].run;
+		threads[i].seed = 1550 + i;
+		threads[i].result.latencies = malloc(maxOps * sizeof(long));
+		ok = threads[i].result.latencies != NULL;
+	}
+	if(!ok)
+	{
+		fprintf(stderr, "cs1550_bench: not enough memory to run %s\n", workloads[w].name);
+		for(i = 0; threads != NULL && i < config.nThreads; i++)
+			free(threads[i].result.latencies);
+		free(all);
+		free(threads);
+		return -ENOMEM;
+	}
+	else;
+	start = now();
+	for(i = 0; i < config.nThreads; i++)
+		pthread_create(&threads[i].thread, NULL, runThread, &threads[i]);
+	for(i = 0; i < config.nThreads; i++)
+		pthread_join(threads[i].thread, NULL);
+	seconds = (now() - start) / 1e9;
+
+	for(i = 0; i < config.nThreads; i++)
+	{
+		memcpy(all + nOps, threads[i].result.latencies, threads[i].result.nOps * sizeof(long));
+		nOps += threads[i].result.nOps;
+		bytes += threads[i].result.bytes;
+		free(threads[i].result.latencies);
+	}
+	qsort(all, nOps, sizeof(long), compareLongs);
+	printf("%-9s %9ld %9.3f %11.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n", workloads[w].name, nOps, seconds,
+		nOps / seconds, bytes / seconds / (1024 * 1024), percentile(all, nOps, 50),
+		percentile(all, nOps, 90), percentile(all, nOps, 99), nOps > 0 ? all[nOps - 1] / 1000.0 : 0);
+	if(workloads[w].makes != NULL && nOps > 0)
+		*workloads[w].makes = 1;
+	else;
+	free(all);
+	free(threads);
+	return 0;
+}
+
+// Whether name is in the comma separated list
+static int listed(const char *list, const char *name)
+{
+	long len = strlen(name);
+	const char *p = list;
+
+	while((p = strstr(p, name)) != NULL)
+	{
+		if((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+			return 1;
+		else;
+		p += len;
+	}
+	return 0;
+}
+
+// Whether every name in the comma separated list is a workload or "all"
+static int knownWorkloads(const char *list)
+{
+	char *copy = strdup(list);
+	char *name;
+	int res = copy != NULL;
+
+	for(name = res ? strtok(copy, ",") : NULL; name != NULL && res; name = strtok(NULL, ","))
+	{
+		size_t w;
+		for(w = 0; w < N_WORKLOADS && strcmp(name, workloads[w].name) != 0; w++);
+		res = w < N_WORKLOADS || strcmp(name, "all") == 0;
+	}
+	free(copy);
+	return res;
+}
+
+// Prints the line of the engine's statistics that says what the checksums
+// cost, the time spent working them out and checking them
+static void printChecksums()
+{
+	long size;
+	char *stats = cs1550_read_stats(&size);
+	char *line = stats != NULL ? strstr(stats, "checksums:") : NULL;
+
+	if(line != NULL)
+		printf("%.*s\n", (int)strcspn(line, "\n"), line);
+	else;
+	free(stats);
+}
+
+static void usage(const char *name)
+{
+	size_t w;
+
+	fprintf(stderr, "usage: %s [-w workloads] [-t threads] [-s disk MB] [-f file MB] [-b io bytes]\n"
+		"\t[-n ops] [-c cache KB] [-B block size] [-m] [-z] [-D] [-C] [-d dir]\n"
+		"workloads: all", name);
+	for(w = 0; w < N_WORKLOADS; w++)
+		fprintf(stderr, ", %s", workloads[w].name);
+	fprintf(stderr, "\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	cs1550_image_info info;
+	char scratch[] = "/tmp/cs1550benchXXXXXX";
+	char diskPath[4096];
+	char directoriesPath[4096];
+	int all;
+	int opt;
+	int res = 0;
+	size_t w;
+	FILE *disk;
+
+	while((opt = getopt(argc, argv, "w:t:s:f:b:n:c:B:mzDCd:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'w': config.workloads = optarg; break;
+			case 't': config.nThreads = atoi(optarg); break;
+			case 's': config.diskMB = atol(optarg); break;
+			case 'f': config.fileMB = atol(optarg); break;
+			case 'b': config.ioSize = atol(optarg); break;
+			case 'n': config.nOps = atol(optarg); break;
+			case 'c': options.cacheKB = strtoul(optarg, NULL, 10); break;
+			case 'B': options.blockSize = strtoul(optarg, NULL, 10); break;
+			case 'm': options.useMmap = 1; break;
+			case 'z': options.compress = 1; break;
+			case 'D': options.dedup = 1; break;
+			case 'C': options.checksums = 0; break;
+			case 'd': config.dir = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if(config.nThreads < 1 || config.diskMB < 1 || config.ioSize < 1 || config.nOps < 1 || optind < argc
+		|| !knownWorkloads(config.workloads))
+		usage(argv[0]);
+	else;
+	if(config.nOps > MAX_OPS)
+	{
+		fprintf(stderr, "cs1550_bench: -n can be at most %d, the create workload's names have to fit in 8.3\n", MAX_OPS);
+		return 2;
+	}
+	else;
+
+	if(config.dir == NULL && (config.dir = mkdtemp(scratch)) == NULL)
+	{
+		perror("cs1550_bench: could not make a scratch directory");
+		return 1;
+	}
+	else;
+	snprintf(diskPath, sizeof(diskPath), "%s/.disk", config.dir);
+	snprintf(directoriesPath, sizeof(directoriesPath), "%s/.directories", config.dir);
+	if((disk = fopen(diskPath, "wb")) == NULL)
+	{
+		perror("cs1550_bench: could not make the scratch image");
+		return 1;
+	}
+	else;
+	unlink(directoriesPath);
+	if(ftruncate(fileno(disk), config.diskMB * 1024 * 1024) < 0)
+	{
+		perror("cs1550_bench: could not size the scratch image");
+		return 1;
+	}
+	else;
+	fclose(disk);
+
+	if(cs1550_open_image(config.dir, &options) < 0)
+		return 1;
+	else;
+	cs1550_info(&info);
+	filesPerDirectory = info.filesPerDirectory > 0 ? info.filesPerDirectory : config.nOps;
+	if(config.nThreads * ((config.nOps + filesPerDirectory - 1) / filesPerDirectory) > MAX_OPS)
+	{
+		fprintf(stderr, "cs1550_bench: %d threads would make more than %d directories\n", config.nThreads, MAX_OPS);
+		res = 2;
+	}
+	else
+	{
+		cs1550_make_directory("/" BENCH_DIR);
+		printf("%d threads, %ld MB disk, %ld MB files, %ld byte I/O, %ld ops, %lu KB cache, %ld byte blocks%s%s%s%s, in %s\n",
+			config.nThreads, config.diskMB, config.fileMB, config.ioSize, config.nOps, options.cacheKB,
+			info.blockSize, options.useMmap ? ", mmap" : "", options.compress ? ", compressed" : "",
+			options.dedup ? ", deduplicated" : "", options.checksums ? "" : ", no checksums", config.dir);
+		printf("%-9s %9s %9s %11s %9s %9s %9s %9s %9s\n", "workload", "ops", "seconds", "ops/s", "MB/s",
+			"p50 us", "p90 us", "p99 us", "max us");
+	}
+
+	all = listed(config.workloads, "all");
+	for(w = 0; w < N_WORKLOADS && res == 0; w++)
+	{
+		if(!all && !listed(config.workloads, workloads[w].name))
+			continue;
+		else;
+		//workloads that read files someone has to write first get them quietly
+		if(workloads[w].needs != NULL && !*workloads[w].needs)
+		{
+			size_t v;
+			for(v = 0; v < N_WORKLOADS && workloads[v].makes != workloads[w].needs; v++);
+			printf("(preparing with %s)\n", workloads[v].name);
+			if(runWorkload(v) < 0)
+			{
+				res = 1;
+				break;
+			}
+			else;
+		}
+		else;
+		if(runWorkload(w) < 0)
+			res = 1;
+		else;
+	}
+
+	if(res == 0)
+		printChecksums();
+	else;
+	cs1550_close_image();
+	//a scratch directory made here goes away again, one given with -d stays
+	if(config.dir == scratch)
+	{
+		unlink(diskPath);
+		unlink(directoriesPath);
+		rmdir(scratch);
+	}
+	else;
+	return res;
+}
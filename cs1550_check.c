@@ -0,0 +1,450 @@
+/*
+	Allocation check for the cs1550 storage engine. Lookups, reads and
+	overwrites of a file that has been written once are meant to make no
+	heap allocations, with or without -o compress and -o dedup, and neither
+	are reads of holes and of a tail that truncate cut off. Appends and
+	writes into holes add extents, and the first read of a file after mount
+	loads its extent map; those only allocate when the map's arrays double,
+	so they get a few allocations for every doubling. malloc, calloc and
+	realloc are wrapped when this is linked, and the calls this thread makes
+	while a round runs are counted. The engine's own threads aren't counted.
+
+	make check
+
+	./cs1550_check [-d dir]
+*/
+
+#include "cs1550_engine.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//Files each check uses
+#define CHECK_DIR "/check"
+#define CHECK_FILE CHECK_DIR "/data.dat"
+#define CHECK_INLINE CHECK_DIR "/small.txt"
+#define CHECK_APPEND CHECK_DIR "/append.dat"
+#define CHECK_SPARSE CHECK_DIR "/sparse.dat"
+#define CHECK_HOLES CHECK_DIR "/holes.dat"
+
+//How big the scratch .disk and the data file are
+#define CHECK_DISK_MB 16
+#define CHECK_BLOCKS 64
+
+//Rounds that warm the engine up before any are counted, then counted ones.
+//The first round writes the file, the second is the first overwrite.
+#define CHECK_WARMUP 2
+#define CHECK_ROUNDS 5
+
+//Allocations an extent map may make each time it doubles: its extents, the
+//file block of each, and the blocks holding the list on disk
+#define CHECK_PER_DOUBLING 3
+
+//One configuration to check
+struct check_case
+{
+	const char *name;
+	int compress;
+	int dedup;
+};
+
+typedef struct check_case check_case;
+
+//What one configuration allocated. failed is set if the engine returned an
+//error or the wrong data.
+struct check_result
+{
+	int failed;
+	long steady;		//lookups, reads and overwrites
+	long holes;		//reads of holes and of a cut off tail
+	long growth;		//appends and writes into holes
+	long cold;		//the first read of a file after mount
+	long growthBudget;	//what growth may make
+	long coldBudget;	//what cold may make
+};
+
+typedef struct check_result check_result;
+
+static const check_case cases[] =
+{
+	{ "plain", 0, 0 },
+	{ "compress", 1, 0 },
+	{ "dedup", 0, 1 },
+	{ "both", 1, 1 },
+};
+
+#define N_CASES (sizeof(cases) / sizeof(cases[0]))
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+//Set while a round runs on the thread doing the checks
+static __thread int counting = 0;
+static __thread long allocations = 0;
+
+void *__wrap_malloc(size_t size)
+{
+	if(counting)
+		allocations++;
+	else;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+	if(counting)
+		allocations++;
+	else;
+	return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size)
+{
+	if(counting)
+		allocations++;
+	else;
+	return __real_realloc(pointer, size);
+}
+
+// Makes an empty .disk of CHECK_DISK_MB in dir
+static int makeDisk(const char *dir)
+{
+	char path[4096];
+	FILE *disk;
+	int res;
+
+	snprintf(path, sizeof(path), "%s/.disk", dir);
+	if((disk = fopen(path, "wb")) == NULL)
+		return -1;
+	else;
+	res = ftruncate(fileno(disk), CHECK_DISK_MB * 1024 * 1024);
+	fclose(disk);
+	return res;
+}
+
+// Removes what a check left in dir
+static void removeImage(const char *dir)
+{
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/.disk", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/.directories", dir);
+	unlink(path);
+}
+
+// Allocations a map that grows from nothing to extents extents may make
+static long mapBudget(long extents)
+{
+	long budget = CHECK_PER_DOUBLING;
+	long n;
+
+	for(n = 1; n < extents; n *= 2)
+		budget += CHECK_PER_DOUBLING;
+	return budget;
+}
+
+// Returns whether all size bytes at buf are zeros
+static int allZeros(const char *buf, long size)
+{
+	long i;
+
+	for(i = 0; i < size; i++)
+	{
+		if(buf[i] != 0)
+			return 0;
+		else;
+	}
+	return 1;
+}
+
+// Writes a block, a hole of three blocks and another block, cuts the file
+// back to the middle of its first block and grows it to its old size again.
+// Reads of the first block, the hole and where the last block was have to
+// give the data that was kept and zeros for the rest. Returns how many
+// allocations the reads made, or -1 if something failed.
+static long runHoles(char *data, char *back, long bs)
+{
+	cs1550_file *file;
+	long failures = 0;
+	long counted;
+
+	if(cs1550_create(CHECK_HOLES) < 0 || cs1550_open_file(CHECK_HOLES, O_RDWR, &file) < 0)
+		return -1;
+	else;
+	memset(data, 'h', bs);
+	if(cs1550_write_file(file, data, bs, 0) != bs || cs1550_write_file(file, data, bs, 4 * bs) != bs
+		|| cs1550_flush_file(file) < 0)
+		failures++;
+	else if(cs1550_truncate_file(CHECK_HOLES, bs / 2) < 0 || cs1550_truncate_file(CHECK_HOLES, 5 * bs) < 0)
+		failures++;
+	else;
+
+	allocations = 0;
+	counting = 1;
+	if(cs1550_read_file(file, back, bs, 0) != bs || memcmp(back, data, bs / 2) != 0
+		|| !allZeros(back + bs / 2, bs - bs / 2))
+		failures++;
+	else;
+	if(cs1550_read_file(file, back, bs, 2 * bs) != bs || !allZeros(back, bs))
+		failures++;
+	else;
+	if(cs1550_read_file(file, back, bs, 4 * bs) != bs || !allZeros(back, bs))
+		failures++;
+	else;
+	counting = 0;
+	counted = allocations;
+	cs1550_close_file(file);
+	return failures > 0 ? -1 : counted;
+}
+
+// Appends CHECK_BLOCKS blocks to one file and writes CHECK_BLOCKS blocks into
+// the hole of another in each counted round, and returns how many allocations
+// the writes made, or -1 if something failed. Every other block of the
+// sparse file is written, so each write splits a hole. The two files take
+// turns allocating, so each appended block is an extent of its own too.
+static long runGrowth(char *data, long bs)
+{
+	cs1550_file *append;
+	cs1550_file *sparse;
+	long counted = 0;
+	long failures = 0;
+	long b;
+	int round;
+
+	if(cs1550_create(CHECK_APPEND) < 0 || cs1550_create(CHECK_SPARSE) < 0
+		|| cs1550_open_file(CHECK_APPEND, O_RDWR, &append) < 0)
+		return -1;
+	else if(cs1550_open_file(CHECK_SPARSE, O_RDWR, &sparse) < 0)
+	{
+		cs1550_close_file(append);
+		return -1;
+	}
+	else;
+
+	//the sparse file starts as one hole with a block after it
+	memset(data, 'z', bs);
+	if(cs1550_write_file(append, data, bs, 0) != bs
+		|| cs1550_write_file(sparse, data, bs, 2L * CHECK_ROUNDS * CHECK_BLOCKS * bs) != bs)
+		failures++;
+	else;
+	for(round = 0; round < CHECK_ROUNDS; round++)
+	{
+		memset(data, 'a' + round, bs);
+		allocations = 0;
+		counting = 1;
+		for(b = 0; b < CHECK_BLOCKS; b++)
+		{
+			long block = (long)round * CHECK_BLOCKS + b;
+			if(cs1550_write_file(append, data, bs, (block + 1) * bs) != bs
+				|| cs1550_write_file(sparse, data, bs, 2 * block * bs) != bs)
+				failures++;
+			else;
+		}
+		counting = 0;
+		counted += allocations;
+		if(cs1550_flush_file(append) < 0 || cs1550_flush_file(sparse) < 0)
+			failures++;
+		else;
+	}
+
+	cs1550_close_file(sparse);
+	cs1550_close_file(append);
+	return failures > 0 ? -1 : counted;
+}
+
+// Reads the first block of the sparse file and the block after its last
+// write once the image has been mounted again, and returns how many
+// allocations loading its extent map made, or -1 if something failed
+static long runCold(const char *dir, const cs1550_options *options, char *data, char *back, long bs)
+{
+	cs1550_file *sparse;
+	long failures = 0;
+	long counted;
+
+	if(cs1550_open_image(dir, options) < 0)
+		return -1;
+	else if(cs1550_open_file(CHECK_SPARSE, O_RDONLY, &sparse) < 0)
+	{
+		cs1550_close_image();
+		return -1;
+	}
+	else;
+	allocations = 0;
+	counting = 1;
+	if(cs1550_read_file(sparse, back, bs, 0) != bs)
+		failures++;
+	else;
+	counting = 0;
+	counted = allocations;
+	memset(data, 'a', bs);
+	if(memcmp(data, back, bs) != 0)
+		failures++;
+	else;
+	memset(data, 0, bs);
+	if(cs1550_read_file(sparse, back, bs, (2L * CHECK_ROUNDS * CHECK_BLOCKS - 1) * bs) != bs
+		|| memcmp(data, back, bs) != 0)
+		failures++;
+	else;
+	cs1550_close_file(sparse);
+	cs1550_close_image();
+	return failures > 0 ? -1 : counted;
+}
+
+// Runs one configuration on a new image in dir
+static check_result runCase(const check_case *test, const char *dir)
+{
+	cs1550_options options = CS1550_DEFAULT_OPTIONS;
+	check_result result = { 1, 0, 0, 0, 0, 0, 0 };
+	cs1550_image_info info;
+	cs1550_file *file;
+	cs1550_file *small;
+	struct stat st;
+	char *data;
+	char *back;
+	long failures = 0;
+	long bs;
+	long b;
+	int round;
+
+	options.compress = test->compress;
+	options.dedup = test->dedup;
+	options.scrubKB = 0;
+	if(makeDisk(dir) < 0 || cs1550_open_image(dir, &options) < 0)
+		return result;
+	else;
+	cs1550_info(&info);
+	bs = info.blockSize;
+	data = malloc(bs);
+	back = malloc(bs);
+	if(data == NULL || back == NULL || cs1550_make_directory(CHECK_DIR) < 0 || cs1550_create(CHECK_FILE) < 0
+		|| cs1550_create(CHECK_INLINE) < 0 || cs1550_open_file(CHECK_FILE, O_RDWR, &file) < 0)
+	{
+		cs1550_close_image();
+		free(data);
+		free(back);
+		return result;
+	}
+	else if(cs1550_open_file(CHECK_INLINE, O_RDWR, &small) < 0)
+	{
+		cs1550_close_file(file);
+		cs1550_close_image();
+		free(data);
+		free(back);
+		return result;
+	}
+	else;
+
+	//every block of a round holds the same bytes, so flush can share and
+	//compress them and the next round has to undo both
+	for(round = 0; round < CHECK_WARMUP + CHECK_ROUNDS; round++)
+	{
+		allocations = 0;
+		counting = round >= CHECK_WARMUP;
+		for(b = 0; b < CHECK_BLOCKS; b++)
+		{
+			if(cs1550_lookup(CHECK_FILE, &st) < 0)
+				failures++;
+			else;
+			if(round > 0)
+			{
+				memset(data, 'a' + round - 1, bs);
+				if(cs1550_read_file(file, back, bs, b * bs) != bs || memcmp(data, back, bs) != 0)
+					failures++;
+				else;
+			}
+			else;
+			memset(data, 'a' + round, bs);
+			if(cs1550_write_file(file, data, bs, b * bs) != bs)
+				failures++;
+			else;
+			if(cs1550_write_file(small, data, 16, b % 4 * 16) != 16)
+				failures++;
+			else;
+		}
+		counting = 0;
+		if(round >= CHECK_WARMUP)
+			result.steady += allocations;
+		else;
+		if(cs1550_flush_file(file) < 0 || cs1550_flush_file(small) < 0)
+			failures++;
+		else;
+	}
+	cs1550_close_file(small);
+	cs1550_close_file(file);
+	result.holes = runHoles(data, back, bs);
+
+	//a write into a hole can leave a hole on each side of it
+	result.coldBudget = mapBudget(2L * CHECK_ROUNDS * CHECK_BLOCKS + 2);
+	result.growthBudget = result.coldBudget + mapBudget(CHECK_ROUNDS * CHECK_BLOCKS + 1);
+	result.growth = runGrowth(data, bs);
+	cs1550_close_image();
+	result.cold = result.growth < 0 ? -1 : runCold(dir, &options, data, back, bs);
+	result.failed = failures > 0 || result.holes < 0 || result.growth < 0 || result.cold < 0;
+	free(data);
+	free(back);
+	return result;
+}
+
+int main(int argc, char *argv[])
+{
+	char scratch[] = "/tmp/cs1550checkXXXXXX";
+	const char *dir = NULL;
+	int failed = 0;
+	size_t c;
+	int opt;
+
+	while((opt = getopt(argc, argv, "d:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'd': dir = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-d dir]\n", argv[0]);
+				return 2;
+		}
+	}
+	if(dir == NULL && (dir = mkdtemp(scratch)) == NULL)
+	{
+		perror("cs1550_check: could not make a scratch directory");
+		return 2;
+	}
+	else;
+
+	for(c = 0; c < N_CASES; c++)
+	{
+		check_result res = runCase(&cases[c], dir);
+		int ok = 0;
+		if(res.failed)
+			printf("%-9s FAILED, the engine returned an error or the wrong data\n", cases[c].name);
+		else if(res.steady > 0)
+			printf("%-9s FAILED, %ld allocations in %d rounds of lookup, read and overwrite\n",
+				cases[c].name, res.steady, CHECK_ROUNDS);
+		else if(res.holes > 0)
+			printf("%-9s FAILED, %ld allocations reading holes and a cut off tail\n", cases[c].name, res.holes);
+		else if(res.growth > res.growthBudget)
+			printf("%-9s FAILED, %ld allocations in %d rounds of appends and writes into holes, at most %ld expected\n",
+				cases[c].name, res.growth, CHECK_ROUNDS, res.growthBudget);
+		else if(res.cold > res.coldBudget)
+			printf("%-9s FAILED, %ld allocations on the first read after mount, at most %ld expected\n",
+				cases[c].name, res.cold, res.coldBudget);
+		else
+		{
+			printf("%-9s ok, %ld allocations growing files and %ld on a first read\n",
+				cases[c].name, res.growth, res.cold);
+			ok = 1;
+		}
+		failed |= !ok;
+		removeImage(dir);
+	}
+
+	if(dir == scratch)
+		rmdir(scratch);
+	else;
+	return failed;
+}
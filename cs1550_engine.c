@@ -0,0 +1,7095 @@
+/*
+	FUSE: Filesystem in Userspace
+	Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+	This program can be distributed under the terms of the GNU GPL.
+	See the file COPYING.
+
+	The cs1550 storage engine, the API in cs1550_engine.h. cs1550.c is the
+	FUSE adapter over it.
+
+	make libcs1550.a
+*/
+
+#include "cs1550_engine.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#include <time.h>
+
+#ifndef DEBUGFILE
+#define DEBUGFILE 0
+#endif
+
+#ifndef DEBUGFILEWRITE
+#define DEBUGFILEWRITE 0
+#endif
+
+#ifndef DEBUGFILEREAD
+#define DEBUGFILEREAD 0
+#endif
+
+#ifndef DEBUGALLOCATE
+#define DEBUGALLOCATE 0
+#endif
+
+#ifndef DEBUGCACHE
+#define DEBUGCACHE 0
+#endif
+//size of a disk block in images from before the block size was recorded in
+//block 0, which is also the size of the disk management record at its start
+#define	BLOCK_SIZE 512
+
+//block sizes that can be chosen with -o block_size when a disk is formatted,
+//powers of two from a page up. Disks formatted with smaller blocks before
+//the minimum was raised still mount.
+#define MIN_BLOCK_SIZE 4096
+#define DEFAULT_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE 65536
+
+//we'll use 8.3 filenames
+#define	MAX_FILENAME 8
+#define	MAX_EXTENSION 3
+
+//Size of one record of .directories. Records are part of the format of
+//.directories rather than blocks of .disk, so they keep the size blocks had
+//when the two were the same whatever block size .disk is formatted with.
+#define DIRECTORY_RECORD_SIZE 512
+
+//How many files fit in one record of .directories. A directory with more
+//files than that takes more records, so this doesn't limit how many files
+//a directory can have.
+#define	MAX_FILES_IN_DIR ((DIRECTORY_RECORD_SIZE - (MAX_FILENAME + 1) - sizeof(int)) / \
+	((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long)))
+
+//fext of the entry a directory has in its parent for each directory in it.
+//No file can have it, since '/' is never part of a name.
+#define DIRECTORY_EXTENSION "/"
+
+//The parent of the directories in the root. The root has no records of its
+//own; its directories are the ones whose records are named after them.
+#define ROOT_DIRECTORY -1
+
+// 5MB / 512 byte block = 10240 blocks on our disk. Use a bit less than that for safety's sake in determining size of disk.
+// Only images from before the block count was recorded in block 0 still use this.
+#define BLOCKS_ON_DISK 10240
+	
+//How much data can one block hold?
+#define	MAX_DATA_IN_BLOCK (BLOCK_SIZE - sizeof(size_t) - sizeof(long))
+
+#define DISK_MANAGEMENT_FILLER (BLOCK_SIZE - 2*sizeof(int) - 11*sizeof(long))
+
+//How files are laid out on disk. Images from before extents were added have
+//0 here (the old padding after prevAllocations) and are converted at mount.
+//LAYOUT_EXTENTS images are always BLOCKS_ON_DISK blocks of BLOCK_SIZE bytes;
+//they get LAYOUT_GEOMETRY and a recorded geometry the first time they are
+//mounted.
+#define LAYOUT_CHAIN 0
+#define LAYOUT_EXTENTS 1
+#define LAYOUT_GEOMETRY 2
+
+struct cs1550_disk_management
+{
+	int prevAllocations;	// Marks whether any allocations have been made: 0 if not, 1 is so
+	int layout;		// LAYOUT_CHAIN or LAYOUT_EXTENTS
+	long free;			// Where the allocator starts looking for free blocks
+	long bitmapStart;	// First of the blocks holding the free space bitmap, 0 if there isn't one yet
+	long dirty;		// Set while mounted. If it is still set at mount the bitmap wasn't saved and is rebuilt
+	long blockSize;		// Size of every block on the disk, chosen when it was formatted
+	long nBlocks;		// How many blocks the disk has, block 0 included
+	long journalStart;	// First block of the metadata journal, 0 if the disk has none
+	long journalBlocks;	// How many blocks the journal takes
+	long journalSequence;	// Number of the first journal transaction that may not have reached .directories yet
+	long sharedBlocks;	// Set once -o dedup has let two files share a block. Every mount after that counts the references again
+	long checksumStart;	// First block of the table of block checksums, 0 if the disk has none
+	long checksumBlocks;	// How many blocks the table takes
+		
+	char filler[DISK_MANAGEMENT_FILLER]; // rest of the block is just an empty array to ensure that this struct is 1 block
+};
+
+typedef struct cs1550_disk_management cs1550_disk_management;
+
+//One record of .directories. A directory is every record with its name:
+//the first one holds its first MAX_FILES_IN_DIR files and each one after it
+//the next ones, in the order the records are in the file. Images from
+//before directories could grow have one record per directory, which is the
+//same thing. Records of directories in the root are named after the
+//directory. A directory anywhere deeper is a DIRECTORY_EXTENSION entry in
+//its parent, with nStartBlock the slot of its first record, and its records
+//are named "/" and that slot.
+struct cs1550_directory_entry
+{
+	char dname[MAX_FILENAME	+ 1];	//the directory name (plus space for a nul)
+	int nFiles;			//How many files are in this record. 
+					//Needs to be less than MAX_FILES_IN_DIR
+
+	struct cs1550_file_directory
+	{
+		char fname[MAX_FILENAME + 1];	//filename (plus space for nul)
+		char fext[MAX_EXTENSION + 1];	//extension (plus space for nul)
+		size_t fsize;			//file size
+		long nStartBlock;		//where the first block is on disk
+	} files[MAX_FILES_IN_DIR];		//There is an array of these
+};
+
+typedef struct cs1550_directory_entry cs1550_directory_entry;
+
+//A data block in the old linked layout (LAYOUT_CHAIN). Only images that are
+//being converted to extents are still read this way.
+struct cs1550_disk_block
+{
+	//Two choices for interpreting size: 
+	//	1) how many bytes are being used in this block
+	//	2) how many bytes are left in the file
+	
+	size_t size; // Stores how many bytes are used in this block
+
+	//The next disk block, if needed. This is the next pointer in the linked 
+	//allocation list
+	long nNextBlock;
+
+	//And all the rest of the space in the block can be used for actual data
+	//storage.
+	char data[MAX_DATA_IN_BLOCK];
+};
+
+typedef struct cs1550_disk_block cs1550_disk_block;
+
+//A run of blocks that are next to each other on disk. A file written with
+//-o compress also has compressed extents, which hold one whole unit of
+//fs.compressBlocks file blocks in -nBlocks blocks, see packUnit. A write
+//past the end of a file leaves a hole, an extent with nStartBlock 0 for
+//file blocks that have none on disk and read as zeros.
+struct cs1550_extent
+{
+	long nStartBlock;	//first block of the run, 0 for a hole
+	long nBlocks;		//how many blocks are in the run, negative for a compressed unit
+};
+
+typedef struct cs1550_extent cs1550_extent;
+
+//The blocks of a compressed extent. What doesn't fit in size is padding.
+struct cs1550_packed_unit
+{
+	uint32_t size;			//how many bytes of data there are
+	unsigned char data[];		//the unit compressed by lzCompress
+};
+
+typedef struct cs1550_packed_unit cs1550_packed_unit;
+
+//File data is compressed in units of this many bytes. A unit is only kept
+//compressed if that saves at least one block.
+#define COMPRESS_BYTES 65536
+
+//The shortest match lzCompress looks for, and the bits of the hash of that
+//many bytes that pick a slot in its table of where it last saw them
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_HASH_BITS 12
+
+//Files with these extensions, or in a directory with a file called
+//NOCOMPRESS_NAME, are never compressed. Their data is compressed already.
+#define NOCOMPRESS_NAME "nocomp"
+static const char *compressedExtensions[] = { "gz", "tgz", "bz2", "xz", "zst", "zip", "7z", "rar",
+	"jpg", "png", "gif", "mp3", "mp4", "mkv", "avi", "mov", NULL };
+
+//In the extent layout nStartBlock of a file points at one of these instead of
+//its first data block. The extents list the file's data blocks in order and
+//the data blocks themselves are nothing but file data, a whole block each.
+//The extents fill the rest of the block, fs.extentsPerBlock of them.
+//A file small enough to fit in the rest of the block keeps its data there
+//instead, with nExtents set to INLINE_EXTENTS, and moves it out to a data
+//block when it grows past fs.inlineBytes.
+struct cs1550_extent_block
+{
+	long nExtents;		//how many extents in this block are used, or INLINE_EXTENTS
+	long nNextBlock;	//the next extent block if the list doesn't fit in this one, 0 if not
+
+	cs1550_extent extents[];
+};
+
+typedef struct cs1550_extent_block cs1550_extent_block;
+
+//nExtents of an extent block holding the file's data
+#define INLINE_EXTENTS -1
+
+//The extents making up a file, kept in memory so the block holding any file
+//offset can be found with a binary search instead of reading the extent
+//blocks again. Loaded the first time a file is read or written since mount.
+struct cs1550_extent_map
+{
+	cs1550_extent *extents;		//the file's extents in order
+	long *fileBlocks;		//fileBlocks[k] is the first file block stored in extents[k]
+	long nExtents;			//how many extents are in use
+	long capacity;			//how many extents have been allocated
+	long nBlocks;			//how many file blocks the extents cover
+	long *extentBlocks;		//the blocks on disk holding the extent list, in chain order
+	long nExtentBlocks;
+	long extentBlocksCapacity;	//how many extent blocks have been allocated
+	long dirtyFrom;			//first extent that has changed since the list was last written, MAP_SAVED if none
+	char *inlineData;		//fs.inlineBytes of file data while it is stored in the extent block, NULL if not
+	long compressFrom;		//first file block written since the file was last compressed
+	long dedupFrom;			//first file block written since the file was last deduplicated
+	int loaded;			//the list has been read from disk
+	unsigned long generation;	//tells a file apart from one created later with its name, 0 if it was there at mount
+};
+
+typedef struct cs1550_extent_map cs1550_extent_map;
+
+//dirtyFrom of an extent map whose list on disk is up to date. It is past any
+//extent so that taking the smaller of it and a changed extent's index works.
+#define MAP_SAVED LONG_MAX
+
+//Locks for one record of .directories and its files. They are allocated
+//separately from the directory cache entries because those move when the
+//cache grows. Only the lock of a directory's first record is used as the
+//lock of the whole directory. Whoever holds it exclusively may change the
+//files arrays of its records; everyone else holds it shared, so a file's
+//index can't change while a file lock is held.
+struct cs1550_directory_locks
+{
+	pthread_rwlock_t lock;			//the files arrays of the directory's records
+	pthread_mutex_t recordLock;		//fsize and nStartBlock of this record's files, and writing it out
+	pthread_rwlock_t fileLocks[MAX_FILES_IN_DIR];	//each file's data and extent map, shared to read and exclusive to write
+};
+
+typedef struct cs1550_directory_locks cs1550_directory_locks;
+
+//The records of one directory and a hash table of its entries, so a file is
+//found without looking through every record. Built when .directories is
+//loaded and kept up to date by createFile, makeDirectory and removeFile.
+struct cs1550_directory_index
+{
+	int *records;		//slots of the directory's records, in the order they are in .directories
+	int *open;		//slots of the records with room for another file, the last one is filled first
+	int nRecords;
+	int nOpen;
+	int *buckets;		//slot * MAX_FILES_IN_DIR + index + 1 of a file, 0 if the bucket is empty
+	int nBuckets;		//always a power of two, kept at least twice nFiles
+	int nFiles;
+};
+
+typedef struct cs1550_directory_index cs1550_directory_index;
+
+//A directory in the dentry cache, found by its parent and its name
+struct cs1550_dentry
+{
+	int parent;				//slot of the first record of the directory holding it, or ROOT_DIRECTORY
+	int child;				//slot of its own first record
+	char name[MAX_FILENAME + 1];		//empty for an unused bucket
+};
+
+typedef struct cs1550_dentry cs1550_dentry;
+
+//In-memory copy of .directories. It is loaded once when the filesystem is
+//mounted and every call looks directories and files up here instead of
+//scanning the file. Changes are written through to .directories right away.
+struct cs1550_directory_cache
+{
+	cs1550_directory_entry *entries;	//same order as the records in .directories
+	cs1550_directory_locks **locks;		//locks for each entry
+	cs1550_extent_map *maps;		//MAX_FILES_IN_DIR extent maps for each entry
+	int *heads;				//heads[slot] is the slot of the first record of slot's directory
+	cs1550_directory_index **indexes;	//for the first record of every directory, NULL for the others
+	int nRecords;				//how many entries are in use
+	int capacity;				//how many entries have been allocated
+	int *directories;			//slot of the first record of every directory in the root, in the order they were made
+	int nDirectories;
+	cs1550_dentry *dentries;		//hash table of every directory, so a path is walked in memory
+	int nDentryBuckets;			//always a power of two, kept at least twice nDentries
+	int nDentries;
+};
+
+typedef struct cs1550_directory_cache cs1550_directory_cache;
+
+//What cs1550_open_file remembers about a file so that read and write don't
+//have to parse the path and search the directory cache again. Callers only
+//see it as a cs1550_file, until cs1550_close_file frees it.
+struct cs1550_file_handle
+{
+	int slot;		//directory cache slot of the record holding the file
+	int index;		//index of the file in that record's files array when it was last looked up
+	char fname[MAX_FILENAME + 1];	//the file's name, to find it again if unlink moved it to another index
+	char fext[MAX_EXTENSION + 1];
+	unsigned long generation;	//the file's generation, so a new file with its name isn't taken for it
+	pthread_mutex_t lock;	//dirty and the read-ahead state, which concurrent requests on the handle share
+	int dirty;		//the directory record has changed and still has to be written out
+	long nextOffset;	//where the last read ended, a read starting here is sequential
+	long window;		//how many blocks to read ahead, 0 after a random read
+	long readAheadEnd;	//file block the read-ahead has reached
+	char *stats;		//for CS1550_STATS_PATH, what it showed when it was opened, NULL for other files
+	long statsSize;
+	cs1550_extent *released;	//runs the file stopped using, freed by flush once what replaced them is written back
+	long nReleased;
+	long releasedCapacity;		//how many runs released has room for
+	long writtenFrom;		//file blocks from writtenFrom up to writtenTo may have changed in the block
+	long writtenTo;			//cache through the handle since its last flush, none if they are equal
+};
+
+typedef struct cs1550_file_handle cs1550_file_handle;
+
+//Read-ahead window limits in blocks. The window starts at the minimum on the
+//second sequential read and doubles on each one after that.
+#define READAHEAD_MIN 8
+#define READAHEAD_MAX 256
+
+//Most blocks moved between the block cache and .disk with one preadv or
+//pwritev
+#define IO_CLUSTER 64
+
+//Free space bitmap, one bit per block on disk that is set when the block is
+//in use. It lives in memory while mounted and only the parts that changed
+//are written back to disk, by saveAllocator.
+struct cs1550_allocator
+{
+	unsigned char *bitmap;		//fs.bitmapBlocks blocks worth of bits
+	unsigned char *dirty;		//one flag per bitmap block that changed since it was written
+	long nFree;			//how many blocks are free
+	long cursor;			//where the next search for free blocks starts
+};
+
+typedef struct cs1550_allocator cs1550_allocator;
+
+//How many allocation pools there are. Threads are spread over them in the
+//order they first allocate, so up to this many writers never share one.
+#define ALLOCATION_POOLS 8
+
+//Blocks a pool takes from the free space bitmap at a time. Allocations this
+//big or bigger skip the pools and go straight to the bitmap.
+#define POOL_BATCH 64
+
+//A run of free blocks reserved from the bitmap for the threads using one
+//pool. The blocks are already marked as used in the bitmap, so small
+//allocations only take the pool's lock. Whatever is left goes back to the
+//bitmap when no files are open, when the disk runs out and at unmount.
+struct cs1550_allocation_pool
+{
+	pthread_mutex_t lock;
+	long start;			//first reserved block not handed out yet
+	long nBlocks;			//how many reserved blocks are left
+	unsigned long allocations;	//allocations served by this pool
+	unsigned long blocks;		//blocks handed out by this pool
+	unsigned long refills;		//times the pool reserved another batch
+	unsigned long returns;		//times leftover blocks went back to the bitmap
+};
+
+typedef struct cs1550_allocation_pool cs1550_allocation_pool;
+
+//Where the hash of a block's data last led, for -o dedup. Block 0 marks an
+//empty slot.
+struct cs1550_dedup_entry
+{
+	uint64_t hash;
+	long block;
+};
+
+typedef struct cs1550_dedup_entry cs1550_dedup_entry;
+
+//A block more than one file uses. Block 0 marks an empty slot.
+struct cs1550_shared_block
+{
+	long block;
+	long references;		//how many extents point at it, at least 2
+};
+
+typedef struct cs1550_shared_block cs1550_shared_block;
+
+//Smallest size of the dedup index and of the shared block table
+#define DEDUP_MIN_SLOTS 1024
+
+//Block deduplication for -o dedup. When a file is flushed each whole data
+//block written since the last flush is looked up in index by the hash of
+//its data, and if the block found there holds the same data the file points
+//at that one instead and its own block is freed. Blocks in use by more than
+//one file are in shared with how many use them; every other block has one
+//user. Writes never change a shared block, they copy it first. The index
+//only lives in memory and starts out empty at each mount, while the
+//reference counts are counted again from the extent lists.
+struct cs1550_dedup
+{
+	int active;			//-o dedup is on or the image already has shared blocks
+	cs1550_dedup_entry *index;	//open addressing on the hash, a power of two slots
+	long indexSlots;
+	long nIndexed;
+	unsigned char *indexed;		//one bit per block, set while its index entry still matches its data
+	cs1550_shared_block *shared;	//open addressing on the block number, a power of two slots
+	long sharedSlots;
+	long nShared;
+	unsigned long hashed;		//blocks looked up in the index
+	unsigned long deduplicated;	//blocks that were found there and shared
+	unsigned long copies;		//shared blocks a write copied
+	pthread_mutex_t lock;		//everything above but active
+};
+
+typedef struct cs1550_dedup cs1550_dedup;
+
+//Reversed polynomial of CRC32C, the Castagnoli CRC
+#define CRC32C_POLYNOMIAL 0x82F63B78u
+
+//With the crc32 instruction three runs of this many bytes are summed at once,
+//since one run alone waits on each instruction before starting the next
+#define CRC_LANE 256
+
+//How long the scrub thread waits between batches of blocks
+#define SCRUB_INTERVAL_MS 100
+
+//Times the scrub thread reads a block that didn't match its checksum again
+//before giving up on it for this pass, if writes keep getting in the way
+#define SCRUB_RETRIES 3
+
+//A CRC32C of every block of .disk that holds file data, an extent list or
+//the bitmap, unless -o nochecksums is given. The table is kept in memory
+//and saved to its own blocks with the bitmap. A block's checksum changes
+//whenever it is written to .disk and is checked whenever it is read from
+//there, and the scrub thread slowly reads every block again to find the
+//ones that went bad while nobody read them. After a crash the table may be
+//older than the blocks, so the mount that rebuilds the bitmap sums every
+//block in use again.
+struct cs1550_checksums
+{
+	uint32_t *sums;			//one per block, 0 for a block that has none, NULL if checksums are off
+	unsigned char *dirty;		//one per block of the table, set when it has to be saved
+	unsigned char *changed;		//with -o mmap, one bit per block written through the mapping since it was summed
+	unsigned char *verified;	//with -o mmap, one bit per block that was checked or summed since mount
+	unsigned long started;		//writes to .disk that change checksums, begun
+	unsigned long finished;		//and done, so the scrub thread can tell if one overlapped its read
+	pthread_t thread;		//runs scrubThread
+	pthread_mutex_t lock;		//stopping
+	pthread_cond_t wake;		//signalled at unmount
+	int scrubbing;			//the scrub thread is running
+	int stopping;			//set at unmount, the scrub thread exits
+};
+
+typedef struct cs1550_checksums cs1550_checksums;
+
+//One block of .disk held in the block cache
+struct cs1550_cache_entry
+{
+	long block;				//which block this is, -1 if the entry is unused
+	int dirty;				//changed since it was last written to .disk
+	char *data;				//the block's data, fs.blockSize bytes
+	struct cs1550_cache_entry *hashNext;	//next entry in the same hash bucket
+	struct cs1550_cache_entry *prev;	//LRU list, most recently used first
+	struct cs1550_cache_entry *next;
+};
+
+typedef struct cs1550_cache_entry cs1550_cache_entry;
+
+//Write-back cache of file data blocks, keyed by block number. Reads are
+//served from here when they can be and writes only change the cached copy.
+//Dirty blocks go to .disk when they are evicted, when a file is flushed or
+//synced and at unmount. The least recently used entry is evicted first.
+struct cs1550_block_cache
+{
+	cs1550_cache_entry *entries;
+	char *buffer;				//the data of every entry
+	long nEntries;				//0 if the cache is turned off
+	cs1550_cache_entry **buckets;
+	long nBuckets;				//always a power of two
+	cs1550_cache_entry lru;			//head of the LRU list, lru.prev is the next to be evicted
+	unsigned long hits;			//blocks found in the cache
+	unsigned long misses;			//blocks that had to be read from .disk
+	unsigned long evictions;		//entries reused for another block
+	unsigned long writebacks;		//dirty blocks written to .disk
+	unsigned long readAheads;		//blocks read into the cache before they were asked for
+};
+
+typedef struct cs1550_block_cache cs1550_block_cache;
+
+//Space the metadata journal is given when it is created, at most a
+//sixteenth of the disk
+#define JOURNAL_BYTES (256 * 1024)
+
+//Most directory records one journal transaction holds
+#define JOURNAL_RECORDS 32
+
+//Longest a record that nobody waits for stays in memory before the journal
+//thread commits it
+#define JOURNAL_INTERVAL_MS 50
+
+//Marks the start of a transaction in the journal
+#define JOURNAL_MAGIC 0x63734A4CL
+
+//A directory record as it is logged in the journal
+struct cs1550_journal_record
+{
+	long slot;			//which record of .directories this replaces
+	cs1550_directory_entry entry;
+};
+
+typedef struct cs1550_journal_record cs1550_journal_record;
+
+//Start of every transaction in the journal. The records follow it and the
+//whole transaction is padded to a multiple of the block size.
+struct cs1550_journal_header
+{
+	long magic;			//JOURNAL_MAGIC
+	long sequence;			//transactions are numbered one after the other
+	long nRecords;
+	unsigned long checksum;		//of the header and the records, computed with this field 0
+};
+
+typedef struct cs1550_journal_header cs1550_journal_header;
+
+//Write-ahead journal for .directories. Directory records are gathered in
+//memory and a thread writes them to the journal region of .disk as one
+//transaction with one fdatasync, then writes them in place. Operations that
+//have to be durable wait for the transaction holding their record, so many
+//of them share one sync. Records nobody waits for are committed within
+//JOURNAL_INTERVAL_MS. When the region fills up, .directories is synced and
+//the journal starts over from the beginning; at mount every transaction
+//from journalSequence on is written in place again.
+struct cs1550_journal
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work;			//signalled when a transaction should be committed
+	pthread_cond_t done;			//broadcast when a commit finishes or pending has room again
+	pthread_t thread;			//runs journalThread
+	int active;				//0 when there is no journal, records are then written in place
+	int stopping;				//set at unmount, the thread commits what is left and exits
+	int error;				//set once a commit fails, every later wait returns it
+	cs1550_journal_record *pending;		//records gathered for the next transaction
+	cs1550_journal_record *committing;	//records of the transaction being written
+	long nPending;
+	char *buffer;				//one transaction as it is written
+	long head;				//offset in the journal region for the next transaction
+	long sequence;				//number of the transaction being gathered
+	long committed;				//number of the last transaction that is on disk
+	long wanted;				//highest transaction number someone is waiting for
+	unsigned long commits;			//transactions written
+	unsigned long records;			//records written in them
+	unsigned long checkpoints;		//times the journal started over
+};
+
+typedef struct cs1550_journal cs1550_journal;
+
+//Scratch memory each thread has for the buffers a call only needs while it
+//runs, enough for a few blocks of the biggest size
+#define ARENA_BYTES (4 * MAX_BLOCK_SIZE)
+
+//A thread's scratch memory. It is allocated the first time the thread needs
+//a buffer and freed when the thread exits, so calls after that never go to
+//malloc for one. Buffers are taken with arenaPush and given back with
+//arenaPop in the reverse order.
+struct cs1550_arena
+{
+	char *memory;			//ARENA_BYTES, NULL until the thread first needs it
+	long used;			//bytes handed out and not given back yet
+};
+
+typedef struct cs1550_arena cs1550_arena;
+
+//How CS1550_STATS_PATH shows up in the root directory
+#define STATS_NAME ".stats"
+
+//Calls of the API whose calls, errors and latency are counted
+enum { OP_LOOKUP, OP_LIST, OP_MKDIR, OP_CREATE, OP_REMOVE, OP_OPEN, OP_READ, OP_WRITE,
+	OP_TRUNCATE, OP_FLUSH, OP_CLOSE, OP_SYNC, N_OPS };
+
+static const char *opNames[N_OPS] = { "lookup", "list", "mkdir", "create", "remove", "open",
+	"read", "write", "truncate", "flush", "close", "sync" };
+
+//Latency histogram buckets. Bucket i counts calls that took less than 2^i
+//microseconds and the last one everything slower.
+#define LATENCY_BUCKETS 24
+
+//Counters for one operation
+struct cs1550_op_stats
+{
+	unsigned long calls;
+	unsigned long errors;			//calls that returned a negative errno
+	unsigned long nanoseconds;		//time spent in all calls together
+	unsigned long latency[LATENCY_BUCKETS];
+};
+
+typedef struct cs1550_op_stats cs1550_op_stats;
+
+//Calls made on one of the backing files. Copies to and from the mapping
+//with -o mmap aren't calls and aren't counted.
+struct cs1550_io_stats
+{
+	unsigned long reads;
+	unsigned long readBytes;
+	unsigned long writes;
+	unsigned long writeBytes;
+	unsigned long syncs;			//fsync, fdatasync and msync
+};
+
+typedef struct cs1550_io_stats cs1550_io_stats;
+
+//Always-on statistics, shown in CS1550_STATS_PATH. Every counter is only changed
+//with __sync_fetch_and_add, so no lock is needed and updates never get lost.
+struct cs1550_stats
+{
+	cs1550_op_stats ops[N_OPS];
+	cs1550_io_stats disk;
+	cs1550_io_stats directories;
+	unsigned long allocations;		//runs of blocks taken from the bitmap
+	unsigned long allocatedBlocks;
+	unsigned long frees;			//runs of blocks given back to the bitmap
+	unsigned long freedBlocks;
+	unsigned long packedUnits;		//units of file data compressed with -o compress
+	unsigned long packedBlocks;		//blocks those units took before
+	unsigned long storedBlocks;		//and after
+	unsigned long incompressible;		//units that wouldn't have saved a block
+	unsigned long unpackedUnits;		//compressed units a write turned back into plain blocks
+	unsigned long summedBlocks;		//checksums worked out for blocks written to .disk
+	unsigned long verifiedBlocks;		//blocks read from .disk and checked
+	unsigned long badBlocks;		//blocks that didn't match their checksum
+	unsigned long checksumNanoseconds;	//time spent on both
+	unsigned long scrubbedBlocks;		//blocks the scrub thread checked
+	unsigned long scrubPasses;		//times it got through the whole disk
+};
+
+typedef struct cs1550_stats cs1550_stats;
+
+//Everything the engine keeps around while an image is open
+struct cs1550_context
+{
+	int diskFd;			//.disk, opened once at mount and used with pread/pwrite
+	int directoriesFd;		//.directories, opened the same way
+	int imageFd;			//the directory holding .disk and .directories, or AT_FDCWD
+	char *diskMap;			//all of .disk when mounted with -o mmap, NULL otherwise
+	off_t diskMapSize;
+	long blockSize;			//geometry of .disk from block 0, see setGeometry
+	long nBlocks;
+	long bitmapBlocks;		//how many blocks the free space bitmap takes at one bit per block
+	long extentsPerBlock;		//how many extents fit in one extent block
+	long inlineBytes;		//how much file data fits in one extent block instead
+	long compressBlocks;		//how many blocks of file data are compressed together
+	cs1550_disk_management management;	//block 0, written back by saveAllocator
+	cs1550_allocator allocator;
+	cs1550_allocation_pool pools[ALLOCATION_POOLS];
+	int nextPool;			//pool handed to the next thread that allocates
+	int openFiles;			//handles open, the pools are emptied when this drops to 0
+	unsigned long generations;	//last generation given to a created file
+	cs1550_directory_cache directories;
+	cs1550_block_cache cache;
+	cs1550_journal journal;
+	cs1550_dedup dedup;
+	cs1550_checksums checksums;
+	cs1550_stats stats;
+
+	//The API is called from several threads at once. Locks are always taken
+	//in this order: namespaceLock, a directory's lock, one of its file locks,
+	//its record lock, the journal lock, an allocation pool's lock, the dedup
+	//lock, allocatorLock, cacheLock. A file handle's lock can be taken with
+	//any of these held, but nothing else is locked while it is held. The
+	//scrub thread's lock is never held with another.
+	pthread_rwlock_t namespaceLock;		//exclusive only to add records and directories, which can move the cache arrays
+	pthread_mutex_t allocatorLock;		//the allocator and the disk management block
+	pthread_mutex_t cacheLock;		//the block cache
+};
+
+typedef struct cs1550_context cs1550_context;
+
+static cs1550_context fs = { -1, -1, AT_FDCWD };
+
+//Index into fs.pools of the pool the current thread allocates from, -1
+//until its first allocation
+static __thread int poolIndex = -1;
+
+//The current thread's scratch memory, and the key that frees it when the
+//thread exits
+static __thread cs1550_arena arena;
+static pthread_key_t arenaKey;
+static pthread_once_t arenaOnce = PTHREAD_ONCE_INIT;
+
+//CRC32C lookup tables, crcTable[k][b] being the CRC of byte b followed by k
+//zero bytes and crcShift[k][b] what CRC_LANE zero bytes turn byte k of a CRC
+//holding b into, and the function initCrc picked to use them or not
+static uint32_t crcTable[8][256];
+static uint32_t crcShift[4][256];
+static uint32_t (*crc32cUpdate)(uint32_t crc, const unsigned char *data, long size);
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+//What the image was opened with
+static const cs1550_options defaultOptions = CS1550_DEFAULT_OPTIONS;
+static cs1550_options options = CS1550_DEFAULT_OPTIONS;
+
+// Counts a call that moved bytes to or from one of the backing files
+static void countIO(cs1550_io_stats *io, int write, long bytes)
+{
+	if(write)
+	{
+		__sync_fetch_and_add(&io->writes, 1);
+		__sync_fetch_and_add(&io->writeBytes, bytes);
+	}
+	else
+	{
+		__sync_fetch_and_add(&io->reads, 1);
+		__sync_fetch_and_add(&io->readBytes, bytes);
+	}
+}
+
+// Counts a call that synced one of the backing files
+static void countSync(cs1550_io_stats *io)
+{
+	__sync_fetch_and_add(&io->syncs, 1);
+}
+
+// Reads a counter that other threads may be changing
+static unsigned long counter(unsigned long *value)
+{
+	return __sync_fetch_and_add(value, 0);
+}
+
+//Starts timing an operation
+static long opStart(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Makes the key whose destructor frees a thread's arena
+static void makeArenaKey(void)
+{
+	pthread_key_create(&arenaKey, free);
+}
+
+// Takes size bytes of the current thread's arena. Returns NULL if the arena
+// couldn't be allocated or is used up.
+static void *arenaPush(long size)
+{
+	size = (size + 15) & ~15L;
+	if(arena.memory == NULL)
+	{
+		pthread_once(&arenaOnce, makeArenaKey);
+		arena.memory = malloc(ARENA_BYTES);
+		if(arena.memory == NULL)
+			return NULL;
+		else;
+		pthread_setspecific(arenaKey, arena.memory);
+	}
+	else;
+	if(arena.used + size > ARENA_BYTES)
+		return NULL;
+	else;
+	arena.used += size;
+	return arena.memory + arena.used - size;
+}
+
+// Gives back the last buffer of size bytes taken with arenaPush
+static void arenaPop(long size)
+{
+	arena.used -= (size + 15) & ~15L;
+}
+
+// Reads size bytes of .disk at position into buf
+static int readDisk(off_t position, void *buf, long size)
+{
+	if(fs.diskMap != NULL)
+	{
+		if(position + size > fs.diskMapSize)
+			return -EIO;
+		else;
+		memcpy(buf, fs.diskMap + position, size);
+		return 0;
+	}
+	else if(pread(fs.diskFd, buf, size, position) != size)
+		return -EIO;
+	else;
+	countIO(&fs.stats.disk, 0, size);
+	return 0;
+}
+
+// Writes size bytes from buf to .disk at position
+static int writeDisk(off_t position, const void *buf, long size)
+{
+	if(fs.diskMap != NULL)
+	{
+		if(position + size > fs.diskMapSize)
+			return -EIO;
+		else;
+		memcpy(fs.diskMap + position, buf, size);
+		return 0;
+	}
+	else if(pwrite(fs.diskFd, buf, size, position) != size)
+		return -EIO;
+	else;
+	countIO(&fs.stats.disk, 1, size);
+	return 0;
+}
+
+// Returns the CRC32C of size bytes carried on from crc, with lookup tables
+// eight bytes at a time
+static uint32_t crc32cSoftware(uint32_t crc, const unsigned char *data, long size)
+{
+	#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while(size >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, data, 8);
+		word ^= crc;
+		crc = crcTable[7][word & 0xff] ^ crcTable[6][(word >> 8) & 0xff]
+			^ crcTable[5][(word >> 16) & 0xff] ^ crcTable[4][(word >> 24) & 0xff]
+			^ crcTable[3][(word >> 32) & 0xff] ^ crcTable[2][(word >> 40) & 0xff]
+			^ crcTable[1][(word >> 48) & 0xff] ^ crcTable[0][word >> 56];
+		data += 8;
+		size -= 8;
+	}
+	#endif
+	while(size-- > 0)
+		crc = crcTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+// Carries a CRC on over CRC_LANE zero bytes
+static uint32_t crcShiftLane(uint32_t crc)
+{
+	return crcShift[0][crc & 0xff] ^ crcShift[1][(crc >> 8) & 0xff]
+		^ crcShift[2][(crc >> 16) & 0xff] ^ crcShift[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+// The same with the SSE4.2 crc32 instruction, which initCrc only picks on
+// CPUs that have it. Three lanes are summed side by side, the second and
+// third from 0, and joined by carrying the CRC so far over the next lane.
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char *data, long size)
+{
+	uint64_t crc64 = crc;
+	long i;
+
+	while(size >= 3 * CRC_LANE)
+	{
+		uint64_t crc1 = 0;
+		uint64_t crc2 = 0;
+		for(i = 0; i < CRC_LANE; i += 8)
+		{
+			uint64_t words[3];
+			memcpy(&words[0], data + i, 8);
+			memcpy(&words[1], data + CRC_LANE + i, 8);
+			memcpy(&words[2], data + 2 * CRC_LANE + i, 8);
+			crc64 = __builtin_ia32_crc32di(crc64, words[0]);
+			crc1 = __builtin_ia32_crc32di(crc1, words[1]);
+			crc2 = __builtin_ia32_crc32di(crc2, words[2]);
+		}
+		crc64 = crcShiftLane(crcShiftLane(crc64) ^ crc1) ^ crc2;
+		data += 3 * CRC_LANE;
+		size -= 3 * CRC_LANE;
+	}
+	while(size >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, data, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+		data += 8;
+		size -= 8;
+	}
+	crc = crc64;
+	while(size-- > 0)
+		crc = __builtin_ia32_crc32qi(crc, *data++);
+	return crc;
+}
+#endif
+
+// Fills in the CRC32C lookup tables and picks the fastest way this CPU has
+// to work CRC32C out
+static void initCrc(void)
+{
+	uint32_t crc;
+	int i;
+	int k;
+
+	for(i = 0; i < 256; i++)
+	{
+		crc = i;
+		for(k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+		crcTable[0][i] = crc;
+	}
+	for(k = 1; k < 8; k++)
+	{
+		for(i = 0; i < 256; i++)
+			crcTable[k][i] = (crcTable[k - 1][i] >> 8) ^ crcTable[0][crcTable[k - 1][i] & 0xff];
+	}
+	//carrying a CRC over zero bytes is linear, so each entry is the XOR of
+	//what it does to the bits that are set
+	for(i = 0; i < 32; i++)
+	{
+		uint32_t bit = 1u << i;
+		for(k = 0; k < CRC_LANE; k++)
+			bit = crcTable[0][bit & 0xff] ^ (bit >> 8);
+		for(k = 0; k < 256; k++)
+		{
+			if(k & (1 << (i % 8)))
+				crcShift[i / 8][k] ^= bit;
+			else;
+		}
+	}
+	crc32cUpdate = crc32cSoftware;
+	#if defined(__x86_64__)
+	if(__builtin_cpu_supports("sse4.2"))
+		crc32cUpdate = crc32cHardware;
+	else;
+	#endif
+}
+
+// Returns the CRC32C of one block. 0 marks a block with no checksum, so a
+// block whose CRC comes out as 0 gets 1 instead.
+static uint32_t blockChecksum(const char *data)
+{
+	uint32_t crc = ~crc32cUpdate(~0u, (const unsigned char *)data, fs.blockSize);
+
+	return crc != 0 ? crc : 1;
+}
+
+// Says whether a block's checksum is kept: checksums are on and the block
+// isn't one of those holding the table itself
+static int summedBlock(long block)
+{
+	return fs.checksums.sums != NULL && (block < fs.management.checksumStart
+		|| block >= fs.management.checksumStart + fs.management.checksumBlocks);
+}
+
+// Reads a block's checksum, which other threads may be changing
+static uint32_t loadSum(long block)
+{
+	return __sync_fetch_and_or(&fs.checksums.sums[block], 0);
+}
+
+// Sets a block's checksum and marks its part of the table to be saved
+static void storeSum(long block, uint32_t sum)
+{
+	__sync_lock_test_and_set(&fs.checksums.sums[block], sum);
+	__sync_lock_test_and_set(&fs.checksums.dirty[block * sizeof(uint32_t) / fs.blockSize], 1);
+}
+
+// Reads a block's bit in one of the checksum bitmaps
+static int blockBit(unsigned char *bits, long block)
+{
+	return (__sync_fetch_and_or(&bits[block / 8], 0) >> (block % 8)) & 1;
+}
+
+// Sets or clears a block's bit in one of the checksum bitmaps
+static void setBlockBit(unsigned char *bits, long block, int set)
+{
+	if(set)
+		__sync_fetch_and_or(&bits[block / 8], 1 << (block % 8));
+	else
+		__sync_fetch_and_and(&bits[block / 8], ~(1 << (block % 8)));
+}
+
+// Brackets a write to .disk that changes checksums, for the scrub thread
+static void beginWrite()
+{
+	if(fs.checksums.sums != NULL)
+		__sync_fetch_and_add(&fs.checksums.started, 1);
+	else;
+}
+
+static void endWrite()
+{
+	if(fs.checksums.sums != NULL)
+		__sync_fetch_and_add(&fs.checksums.finished, 1);
+	else;
+}
+
+// Works out the checksums of count blocks from start, which were written to
+// .disk from data
+static void sumBlocks(long start, const char *data, long count)
+{
+	long begin;
+	long i;
+
+	if(fs.checksums.sums == NULL)
+		return;
+	else;
+	begin = opStart();
+	for(i = 0; i < count; i++)
+	{
+		if(summedBlock(start + i))
+			storeSum(start + i, blockChecksum(data + i * fs.blockSize));
+		else;
+	}
+	__sync_fetch_and_add(&fs.stats.summedBlocks, count);
+	__sync_fetch_and_add(&fs.stats.checksumNanoseconds, opStart() - begin);
+}
+
+// Checks count blocks from start, which were read from .disk into data,
+// against their checksums. Blocks written through the mapping since they
+// were last summed are taken as they are. Returns -EIO and says which block
+// if one doesn't match.
+static int verifyBlocks(long start, const char *data, long count)
+{
+	long begin;
+	long i;
+	int res = 0;
+
+	if(fs.checksums.sums == NULL)
+		return 0;
+	else;
+	begin = opStart();
+	for(i = 0; i < count && res == 0; i++)
+	{
+		uint32_t sum = summedBlock(start + i) ? loadSum(start + i) : 0;
+		if(sum != 0 && !blockBit(fs.checksums.changed, start + i) && blockChecksum(data + i * fs.blockSize) != sum)
+		{
+			fprintf(stderr, "cs1550: block %ld does not match its checksum\n", start + i);
+			__sync_fetch_and_add(&fs.stats.badBlocks, 1);
+			res = -EIO;
+		}
+		else;
+	}
+	__sync_fetch_and_add(&fs.stats.verifiedBlocks, i);
+	__sync_fetch_and_add(&fs.stats.checksumNanoseconds, opStart() - begin);
+	return res;
+}
+
+// Reads one whole block of .disk into buf and checks it
+static int readBlock(long block, void *buf)
+{
+	if(readDisk((off_t)block * fs.blockSize, buf, fs.blockSize) < 0)
+		return -EIO;
+	else;
+	return verifyBlocks(block, buf, 1);
+}
+
+// Writes one whole block of .disk from buf and sums it
+static int writeBlock(long block, const void *buf)
+{
+	int res;
+
+	beginWrite();
+	res = writeDisk((off_t)block * fs.blockSize, buf, fs.blockSize);
+	if(res == 0)
+		sumBlocks(block, buf, 1);
+	else;
+	endWrite();
+	return res;
+}
+
+// Works out everything that follows from the block size and block count
+static void setGeometry(long blockSize, long nBlocks)
+{
+	fs.blockSize = blockSize;
+	fs.nBlocks = nBlocks;
+	fs.bitmapBlocks = (nBlocks + 8 * blockSize - 1) / (8 * blockSize);
+	fs.extentsPerBlock = (blockSize - sizeof(cs1550_extent_block)) / sizeof(cs1550_extent);
+	fs.inlineBytes = blockSize - sizeof(cs1550_extent_block);
+	fs.compressBlocks = COMPRESS_BYTES / blockSize;
+}
+
+// Sets up a block cache using about kilobytes KB of memory for block data
+static int initCache(unsigned long kilobytes)
+{
+	cs1550_block_cache *cache = &fs.cache;
+	long i;
+
+	memset(cache, 0, sizeof(cs1550_block_cache));
+	cache->lru.prev = &cache->lru;
+	cache->lru.next = &cache->lru;
+	cache->nEntries = kilobytes * 1024 / fs.blockSize;
+	if(cache->nEntries == 0)
+		return 0;
+	else;
+
+	cache->nBuckets = 1;
+	while(cache->nBuckets < cache->nEntries)
+		cache->nBuckets *= 2;
+	cache->entries = calloc(cache->nEntries, sizeof(cs1550_cache_entry));
+	cache->buffer = malloc(cache->nEntries * fs.blockSize);
+	cache->buckets = calloc(cache->nBuckets, sizeof(cs1550_cache_entry *));
+	if(cache->entries == NULL || cache->buffer == NULL || cache->buckets == NULL)
+		return -ENOMEM;
+	else;
+
+	for(i = 0; i < cache->nEntries; i++)
+	{
+		cs1550_cache_entry *entry = &cache->entries[i];
+		entry->block = -1;
+		entry->data = cache->buffer + i * fs.blockSize;
+		entry->prev = cache->lru.prev;
+		entry->next = &cache->lru;
+		cache->lru.prev->next = entry;
+		cache->lru.prev = entry;
+	}
+	return 0;
+}
+
+// Moves an entry to the front of the LRU list, or to the back if it is
+// unused so that it is the next one handed out
+static void touchEntry(cs1550_cache_entry *entry)
+{
+	cs1550_cache_entry *head = &fs.cache.lru;
+
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	if(entry->block >= 0)
+	{
+		entry->prev = head;
+		entry->next = head->next;
+	}
+	else
+	{
+		entry->prev = head->prev;
+		entry->next = head;
+	}
+	entry->prev->next = entry;
+	entry->next->prev = entry;
+}
+
+// Finds the hash chain link pointing at block's entry, or at the end of the
+// chain if the block isn't cached
+static cs1550_cache_entry **findEntry(long block)
+{
+	cs1550_cache_entry **link = &fs.cache.buckets[block & (fs.cache.nBuckets - 1)];
+
+	while(*link != NULL && (*link)->block != block)
+		link = &(*link)->hashNext;
+	return link;
+}
+
+// Writes a cached block to .disk if it has changed
+static int writeBackEntry(cs1550_cache_entry *entry)
+{
+	cs1550_cache_entry *run[IO_CLUSTER];
+	struct iovec iov[IO_CLUSTER];
+	cs1550_cache_entry *next;
+	long first = entry->block;
+	long n;
+
+	if(!entry->dirty)
+		return 0;
+	else;
+
+	//dirty blocks on either side go out with it in one write
+	while(first > 0 && entry->block - first < IO_CLUSTER / 2
+		&& (next = *findEntry(first - 1)) != NULL && next->dirty)
+		first--;
+	for(n = 0; n < IO_CLUSTER; n++)
+	{
+		next = *findEntry(first + n);
+		if(next == NULL || !next->dirty)
+			break;
+		else;
+		run[n] = next;
+		iov[n].iov_base = next->data;
+		iov[n].iov_len = fs.blockSize;
+	}
+
+	#if DEBUGCACHE
+	printf("Writing back %ld blocks at %ld\n", n, first);
+	#endif
+	beginWrite();
+	if(pwritev(fs.diskFd, iov, n, (off_t)first * fs.blockSize) != n * fs.blockSize)
+	{
+		endWrite();
+		return -EIO;
+	}
+	else;
+	countIO(&fs.stats.disk, 1, n * fs.blockSize);
+	fs.cache.writebacks += n;
+	while(n > 0)
+	{
+		n--;
+		sumBlocks(run[n]->block, run[n]->data, 1);
+		run[n]->dirty = 0;
+	}
+	endWrite();
+	return 0;
+}
+
+// Forgets the block an entry holds without writing it back
+static void dropEntry(cs1550_cache_entry *entry)
+{
+	*findEntry(entry->block) = entry->hashNext;
+	entry->block = -1;
+	entry->dirty = 0;
+	touchEntry(entry);
+}
+
+// Returns the cache entry holding block. A block that isn't cached takes
+// over the least recently used entry, writing it back first if it is dirty,
+// and is read from .disk if load is set or zero filled if the caller is
+// about to overwrite it anyway. Returns NULL if a read or write fails.
+static cs1550_cache_entry *getBlock(long block, int load)
+{
+	cs1550_block_cache *cache = &fs.cache;
+	cs1550_cache_entry **link = findEntry(block);
+	cs1550_cache_entry *entry = *link;
+
+	if(entry != NULL)
+	{
+		cache->hits++;
+		touchEntry(entry);
+		return entry;
+	}
+	else;
+
+	entry = cache->lru.prev;
+	if(entry->block >= 0)
+	{
+		#if DEBUGCACHE
+		printf("Evicting block %ld for block %ld\n", entry->block, block);
+		#endif
+		if(writeBackEntry(entry) < 0)
+			return NULL;
+		else;
+		*findEntry(entry->block) = entry->hashNext;
+		entry->block = -1;
+		cache->evictions++;
+	}
+	else;
+
+	if(load)
+	{
+		cache->misses++;
+		if(readBlock(block, entry->data) < 0)
+		{
+			touchEntry(entry);
+			return NULL;
+		}
+		else;
+	}
+	else
+		memset(entry->data, 0, fs.blockSize);
+
+	//evicting may have changed the chain, so it is searched again
+	link = findEntry(block);
+	entry->block = block;
+	entry->dirty = 0;
+	entry->hashNext = NULL;
+	*link = entry;
+	touchEntry(entry);
+	return entry;
+}
+
+// Reads count blocks from start, none of which are cached, into the cache
+// with one preadv straight into the entries they take over. At most
+// IO_CLUSTER blocks and never more than the cache holds are read; returns
+// how many were, or -EIO. The caller holds the cache lock.
+static long loadBlocks(long start, long count)
+{
+	cs1550_cache_entry *run[IO_CLUSTER];
+	struct iovec iov[IO_CLUSTER];
+	long i;
+
+	if(count > IO_CLUSTER)
+		count = IO_CLUSTER;
+	else;
+	if(count > fs.cache.nEntries)
+		count = fs.cache.nEntries;
+	else;
+	if(count <= 0)
+		return 0;
+	else;
+	//entries taken here are the most recently used, so taking the next one
+	//never evicts them while count is within the size of the cache
+	for(i = 0; i < count; i++)
+	{
+		run[i] = getBlock(start + i, 0);
+		if(run[i] == NULL)
+		{
+			while(i > 0)
+				dropEntry(run[--i]);
+			return -EIO;
+		}
+		else;
+		iov[i].iov_base = run[i]->data;
+		iov[i].iov_len = fs.blockSize;
+	}
+
+	#if DEBUGCACHE
+	printf("Reading %ld blocks at %ld\n", count, start);
+	#endif
+	if(preadv(fs.diskFd, iov, count, (off_t)start * fs.blockSize) != count * fs.blockSize)
+		i = 0;
+	else
+	{
+		countIO(&fs.stats.disk, 0, count * fs.blockSize);
+		for(i = 0; i < count && verifyBlocks(start + i, run[i]->data, 1) == 0; i++);
+	}
+	//a block that failed its checksum is never left in the cache
+	if(i < count)
+	{
+		for(i = 0; i < count; i++)
+			dropEntry(run[i]);
+		return -EIO;
+	}
+	else;
+	return count;
+}
+
+// Copies size bytes starting offset bytes into the run of blocks at start
+// into buf, going through the cache. Blocks that aren't cached are read in
+// with the ones after them that the request also needs. The cache lock is
+// held for one block at a time so an entry can't be evicted while it is
+// being copied.
+static long cacheRead(long start, long offset, char *buf, long size)
+{
+	long last = start + (offset + size - 1) / fs.blockSize;
+	long done = 0;
+
+	while(done < size)
+	{
+		long block = start + (offset + done) / fs.blockSize;
+		long inBlock = (offset + done) % fs.blockSize;
+		long count = fs.blockSize - inBlock;
+		cs1550_cache_entry *entry;
+
+		if(count > size - done)
+			count = size - done;
+		else;
+		pthread_mutex_lock(&fs.cacheLock);
+		entry = *findEntry(block);
+		if(entry == NULL)
+		{
+			long n = 1;
+			while(block + n <= last && n < IO_CLUSTER && *findEntry(block + n) == NULL)
+				n++;
+			n = loadBlocks(block, n);
+			if(n > 0)
+			{
+				fs.cache.misses += n;
+				entry = *findEntry(block);
+			}
+			else;
+		}
+		else
+		{
+			fs.cache.hits++;
+			touchEntry(entry);
+		}
+		if(entry != NULL)
+			memcpy(buf + done, entry->data + inBlock, count);
+		else;
+		pthread_mutex_unlock(&fs.cacheLock);
+		if(entry == NULL)
+			break;
+		else;
+		done += count;
+	}
+	return done > 0 ? done : -EIO;
+}
+
+// Copies size bytes from buf into the cached copies of the run of blocks at
+// start, beginning offset bytes in, and marks them dirty. Only the first
+// valid bytes of the run hold file data, so blocks past that which are only
+// partly written are zero filled instead of read from .disk.
+static long cacheWrite(long start, long offset, const char *buf, long size, long valid)
+{
+	long done = 0;
+
+	while(done < size)
+	{
+		long position = offset + done;
+		long inBlock = position % fs.blockSize;
+		long count = fs.blockSize - inBlock;
+		int whole;
+		cs1550_cache_entry *entry;
+
+		if(count > size - done)
+			count = size - done;
+		else;
+		whole = (inBlock == 0 && count == fs.blockSize);
+		pthread_mutex_lock(&fs.cacheLock);
+		entry = getBlock(start + position / fs.blockSize, !whole && position - inBlock < valid);
+		if(entry != NULL)
+		{
+			memcpy(entry->data + inBlock, buf + done, count);
+			entry->dirty = 1;
+		}
+		else;
+		pthread_mutex_unlock(&fs.cacheLock);
+		if(entry == NULL)
+			break;
+		else;
+		done += count;
+	}
+	return done > 0 ? done : -EIO;
+}
+
+// Reads the blocks of the run of count blocks at start that aren't cached
+// yet into the cache, with one read for every stretch of them
+static int fillCache(long start, long count)
+{
+	long i = 0;
+	int res = 0;
+
+	pthread_mutex_lock(&fs.cacheLock);
+	while(i < count && res == 0)
+	{
+		long n = 0;
+
+		while(i < count && *findEntry(start + i) != NULL)
+			i++;
+		while(i + n < count && n < IO_CLUSTER && *findEntry(start + i + n) == NULL)
+			n++;
+		if(n == 0)
+			break;
+		else;
+		n = loadBlocks(start + i, n);
+		if(n < 0)
+			res = -EIO;
+		else
+		{
+			fs.cache.readAheads += n;
+			i += n;
+		}
+	}
+	pthread_mutex_unlock(&fs.cacheLock);
+	return res;
+}
+
+// Writes every dirty block in the cache to .disk
+static int flushCache()
+{
+	long i;
+	int res = 0;
+
+	pthread_mutex_lock(&fs.cacheLock);
+	for(i = 0; i < fs.cache.nEntries; i++)
+	{
+		if(fs.cache.entries[i].block >= 0 && writeBackEntry(&fs.cache.entries[i]) < 0)
+			res = -EIO;
+		else;
+	}
+	pthread_mutex_unlock(&fs.cacheLock);
+	return res;
+}
+
+// Drops any cached copies of count blocks from start without writing them,
+// used when the blocks are freed
+static void invalidateBlocks(long start, long count)
+{
+	long i;
+
+	pthread_mutex_lock(&fs.cacheLock);
+	//short runs are looked up block by block, long ones check every entry
+	for(i = 0; i < (count < fs.cache.nEntries ? count : fs.cache.nEntries); i++)
+	{
+		cs1550_cache_entry *entry;
+		if(count < fs.cache.nEntries)
+		{
+			entry = *findEntry(start + i);
+			if(entry == NULL)
+				continue;
+			else;
+		}
+		else
+		{
+			entry = &fs.cache.entries[i];
+			if(entry->block < start || entry->block >= start + count)
+				continue;
+			else;
+		}
+		dropEntry(entry);
+	}
+	pthread_mutex_unlock(&fs.cacheLock);
+}
+
+// Writes the cached copies of count blocks from start to .disk if they have
+// changed, for a flush of the file holding them
+static int writeBackBlocks(long start, long count)
+{
+	long i;
+	int res = 0;
+
+	pthread_mutex_lock(&fs.cacheLock);
+	//looked up the same two ways as in invalidateBlocks
+	for(i = 0; i < (count < fs.cache.nEntries ? count : fs.cache.nEntries); i++)
+	{
+		cs1550_cache_entry *entry;
+		if(count < fs.cache.nEntries)
+		{
+			entry = *findEntry(start + i);
+			if(entry == NULL)
+				continue;
+			else;
+		}
+		else
+		{
+			entry = &fs.cache.entries[i];
+			if(entry->block < start || entry->block >= start + count)
+				continue;
+			else;
+		}
+		if(writeBackEntry(entry) < 0)
+			res = -EIO;
+		else;
+	}
+	pthread_mutex_unlock(&fs.cacheLock);
+	return res;
+}
+
+// Maps all of .disk into memory for -o mmap. The image is grown to its full
+// size first so that every block the allocator can hand out is mapped.
+static int mapDisk()
+{
+	off_t size = (off_t)fs.nBlocks * fs.blockSize;
+	struct stat st;
+	void *map;
+
+	if(fstat(fs.diskFd, &st) < 0)
+		return -EIO;
+	else;
+	if(st.st_size < size && ftruncate(fs.diskFd, size) < 0)
+		return -EIO;
+	else if(st.st_size > size)
+		size = st.st_size;
+	else;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fs.diskFd, 0);
+	if(map == MAP_FAILED)
+		return -EIO;
+	else;
+	fs.diskMap = map;
+	fs.diskMapSize = size;
+	return 0;
+}
+
+// Makes sure everything written to .disk so far is on stable storage
+static int syncDisk()
+{
+	if(fs.diskMap != NULL && msync(fs.diskMap, fs.diskMapSize, MS_SYNC) < 0)
+		return -EIO;
+	else;
+	if(fsync(fs.diskFd) < 0)
+		return -EIO;
+	else;
+	countSync(&fs.stats.disk);
+	return 0;
+}
+
+// Calls msync with flags on the pages of the mapping that hold count blocks
+// from start
+static int syncMapped(long start, long count, int flags)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	off_t from = (off_t)start * fs.blockSize / page * page;
+	off_t to = (off_t)(start + count) * fs.blockSize;
+
+	if(msync(fs.diskMap + from, to - from, flags) < 0)
+		return -EIO;
+	else;
+	return 0;
+}
+
+// Checks the blocks of the run at start that size bytes from offset cover,
+// straight out of the mapping with -o mmap. The mapping is the page cache,
+// so a block is only checked the first time it is read after mount.
+static int verifyMapped(long start, long offset, long size)
+{
+	long block = start + offset / fs.blockSize;
+	long last = start + (offset + size - 1) / fs.blockSize;
+	int res = 0;
+
+	if(fs.checksums.sums == NULL)
+		return 0;
+	else;
+	for(; block <= last && res == 0; block++)
+	{
+		if(!blockBit(fs.checksums.verified, block))
+		{
+			res = verifyBlocks(block, fs.diskMap + (off_t)block * fs.blockSize, 1);
+			if(res == 0)
+				setBlockBit(fs.checksums.verified, block, 1);
+			else;
+		}
+		else;
+	}
+	return res;
+}
+
+// Marks the blocks of the run at start that size bytes from offset cover as
+// written through the mapping, so sumChanged sums them again
+static void changeMapped(long start, long offset, long size)
+{
+	long block = start + offset / fs.blockSize;
+	long last = start + (offset + size - 1) / fs.blockSize;
+
+	if(fs.checksums.sums == NULL)
+		return;
+	else;
+	for(; block <= last; block++)
+		setBlockBit(fs.checksums.changed, block, 1);
+}
+
+// Checks the blocks of the run at start that a read of size bytes from
+// offset into buf covered, without the block cache. Blocks buf holds whole
+// are checked there; one at either end that was only partly read is read
+// whole again first.
+static int verifyRead(long start, long offset, const char *buf, long size)
+{
+	long block = start + offset / fs.blockSize;
+	long last = start + (offset + size - 1) / fs.blockSize;
+	char *whole = NULL;
+	int res = 0;
+
+	if(fs.checksums.sums == NULL)
+		return 0;
+	else;
+	for(; block <= last && res == 0; block++)
+	{
+		long from = (block - start) * fs.blockSize - offset;
+		if(from >= 0 && from + fs.blockSize <= size)
+			res = verifyBlocks(block, buf + from, 1);
+		else if(whole == NULL && (whole = arenaPush(fs.blockSize)) == NULL)
+			res = -ENOMEM;
+		else if(readDisk((off_t)block * fs.blockSize, whole, fs.blockSize) < 0)
+			res = -EIO;
+		else
+			res = verifyBlocks(block, whole, 1);
+	}
+	if(whole != NULL)
+		arenaPop(fs.blockSize);
+	else;
+	return res;
+}
+
+// Works out the checksums of the blocks of the run at start that a write of
+// size bytes from buf at offset changed, without the block cache. A block
+// only partly written is read back whole; if that fails it is left without
+// a checksum.
+static void sumWritten(long start, long offset, const char *buf, long size)
+{
+	long block = start + offset / fs.blockSize;
+	long last = start + (offset + size - 1) / fs.blockSize;
+	char *whole = NULL;
+
+	if(fs.checksums.sums == NULL)
+		return;
+	else;
+	for(; block <= last; block++)
+	{
+		long from = (block - start) * fs.blockSize - offset;
+		if(from >= 0 && from + fs.blockSize <= size)
+			sumBlocks(block, buf + from, 1);
+		else if((whole != NULL || (whole = arenaPush(fs.blockSize)) != NULL)
+			&& readDisk((off_t)block * fs.blockSize, whole, fs.blockSize) == 0)
+			sumBlocks(block, whole, 1);
+		else if(summedBlock(block))
+			storeSum(block, 0);
+		else;
+	}
+	if(whole != NULL)
+		arenaPop(fs.blockSize);
+	else;
+}
+
+// Copies size bytes starting offset bytes into the run of blocks at start
+// into buf, straight out of the mapping with -o mmap, through the block
+// cache if it is on and with a single read from .disk otherwise. Blocks
+// are checked against their checksums on the way.
+static long readRun(long start, long offset, char *buf, long size)
+{
+	off_t position = (off_t)start * fs.blockSize + offset;
+
+	if(fs.diskMap != NULL)
+	{
+		if(position + size > fs.diskMapSize || verifyMapped(start, offset, size) < 0)
+			return -EIO;
+		else;
+		memcpy(buf, fs.diskMap + position, size);
+		return size;
+	}
+	else if(fs.cache.nEntries > 0)
+		return cacheRead(start, offset, buf, size);
+	else
+	{
+		long res = pread(fs.diskFd, buf, size, position);
+		if(res > 0)
+			countIO(&fs.stats.disk, 0, res);
+		else;
+		if(res > 0 && verifyRead(start, offset, buf, res) < 0)
+			return -EIO;
+		else;
+		return res;
+	}
+}
+
+// Copies size bytes from buf into the run of blocks at start, beginning
+// offset bytes in, the same three ways readRun reads. valid is how much of
+// the run held file data before, which the cache needs to know.
+static long writeRun(long start, long offset, const char *buf, long size, long valid)
+{
+	off_t position = (off_t)start * fs.blockSize + offset;
+
+	if(fs.diskMap != NULL)
+	{
+		if(position + size > fs.diskMapSize)
+			return -EIO;
+		else;
+		//marked before and after, so a sumChanged that runs while this
+		//copies can't leave them marked as summed
+		beginWrite();
+		changeMapped(start, offset, size);
+		memcpy(fs.diskMap + position, buf, size);
+		changeMapped(start, offset, size);
+		endWrite();
+		return size;
+	}
+	else if(fs.cache.nEntries > 0)
+		return cacheWrite(start, offset, buf, size, valid);
+	else
+	{
+		long res;
+		beginWrite();
+		res = pwrite(fs.diskFd, buf, size, position);
+		if(res > 0)
+		{
+			countIO(&fs.stats.disk, 1, res);
+			sumWritten(start, offset, buf, res);
+		}
+		else;
+		endWrite();
+		return res;
+	}
+}
+
+// Makes the locks for a directory
+static cs1550_directory_locks *newDirectoryLocks()
+{
+	cs1550_directory_locks *locks = malloc(sizeof(cs1550_directory_locks));
+	int i;
+
+	if(locks == NULL)
+		return NULL;
+	else;
+	pthread_rwlock_init(&locks->lock, NULL);
+	pthread_mutex_init(&locks->recordLock, NULL);
+	for(i = 0; i < MAX_FILES_IN_DIR; i++)
+		pthread_rwlock_init(&locks->fileLocks[i], NULL);
+	return locks;
+}
+
+// Destroys and frees the locks of a directory
+static void freeDirectoryLocks(cs1550_directory_locks *locks)
+{
+	int i;
+
+	if(locks == NULL)
+		return;
+	else;
+	pthread_rwlock_destroy(&locks->lock);
+	pthread_mutex_destroy(&locks->recordLock);
+	for(i = 0; i < MAX_FILES_IN_DIR; i++)
+		pthread_rwlock_destroy(&locks->fileLocks[i]);
+	free(locks);
+}
+
+// Makes an empty index for a new directory
+static cs1550_directory_index *newDirectoryIndex()
+{
+	return calloc(1, sizeof(cs1550_directory_index));
+}
+
+// Frees a directory's index
+static void freeDirectoryIndex(cs1550_directory_index *index)
+{
+	if(index == NULL)
+		return;
+	else;
+	free(index->records);
+	free(index->open);
+	free(index->buckets);
+	free(index);
+}
+
+// Adds the record in slot to the end of a directory's records
+static int addRecord(cs1550_directory_index *index, int slot)
+{
+	int *records = realloc(index->records, (index->nRecords + 1) * sizeof(int));
+	int *open;
+
+	if(records == NULL)
+		return -ENOMEM;
+	else;
+	index->records = records;
+	open = realloc(index->open, (index->nRecords + 1) * sizeof(int));
+	if(open == NULL)
+		return -ENOMEM;
+	else;
+	index->open = open;
+	index->records[index->nRecords++] = slot;
+	if(fs.directories.entries[slot].nFiles < MAX_FILES_IN_DIR)
+		index->open[index->nOpen++] = slot;
+	else;
+	return 0;
+}
+
+// FNV-1a over a file's name and extension, for the directory indexes
+static uint32_t nameHash(const char *filename, const char *extension)
+{
+	uint32_t hash = 2166136261u;
+
+	for(; *filename != '\0'; filename++)
+		hash = (hash ^ (unsigned char)*filename) * 16777619u;
+	hash = (hash ^ '.') * 16777619u;
+	for(; *extension != '\0'; extension++)
+		hash = (hash ^ (unsigned char)*extension) * 16777619u;
+	return hash;
+}
+
+// Returns the file a bucket of a directory index points at
+static struct cs1550_file_directory *indexedFile(int position)
+{
+	return &fs.directories.entries[(position - 1) / MAX_FILES_IN_DIR].files[(position - 1) % MAX_FILES_IN_DIR];
+}
+
+// Returns the bucket of a directory index holding the named file, or the
+// empty bucket where it would go. The table has at least one empty bucket.
+static int findBucket(cs1550_directory_index *index, const char *filename, const char *extension)
+{
+	int mask = index->nBuckets - 1;
+	int b = nameHash(filename, extension) & mask;
+
+	while(index->buckets[b] != 0)
+	{
+		struct cs1550_file_directory *file = indexedFile(index->buckets[b]);
+		if(strcmp(file->fname, filename) == 0 && strcmp(file->fext, extension) == 0)
+			return b;
+		else;
+		b = (b + 1) & mask;
+	}
+	return b;
+}
+
+// Adds the file at index i of the record in slot to its directory's index,
+// doubling the hash table first if it would be more than half full
+static int indexFile(cs1550_directory_index *index, int slot, int i)
+{
+	struct cs1550_file_directory *file = &fs.directories.entries[slot].files[i];
+	int b;
+
+	if(2 * (index->nFiles + 1) > index->nBuckets)
+	{
+		int *old = index->buckets;
+		int nOld = index->nBuckets;
+		int nBuckets = nOld > 0 ? nOld * 2 : 64;
+		int *buckets = calloc(nBuckets, sizeof(int));
+		if(buckets == NULL)
+			return -ENOMEM;
+		else;
+		index->buckets = buckets;
+		index->nBuckets = nBuckets;
+		for(b = 0; b < nOld; b++)
+		{
+			if(old[b] != 0)
+			{
+				struct cs1550_file_directory *moved = indexedFile(old[b]);
+				buckets[findBucket(index, moved->fname, moved->fext)] = old[b];
+			}
+			else;
+		}
+		free(old);
+	}
+	else;
+
+	b = findBucket(index, file->fname, file->fext);
+	if(index->buckets[b] == 0)
+		index->nFiles++;
+	else;
+	index->buckets[b] = slot * MAX_FILES_IN_DIR + i + 1;
+	return 0;
+}
+
+// Takes the named file out of its directory's index. The files after it in
+// the same run of full buckets are moved back into the hole when that is
+// nearer their own bucket, so no lookup stops short at it.
+static void unindexFile(cs1550_directory_index *index, const char *filename, const char *extension)
+{
+	int mask = index->nBuckets - 1;
+	int hole = findBucket(index, filename, extension);
+	int b = hole;
+
+	if(index->buckets[hole] == 0)
+		return;
+	else;
+	index->buckets[hole] = 0;
+	index->nFiles--;
+	while(index->buckets[b = (b + 1) & mask] != 0)
+	{
+		struct cs1550_file_directory *file = indexedFile(index->buckets[b]);
+		int home = nameHash(file->fname, file->fext) & mask;
+		if(((b - home) & mask) >= ((b - hole) & mask))
+		{
+			index->buckets[hole] = index->buckets[b];
+			index->buckets[b] = 0;
+			hole = b;
+		}
+		else;
+	}
+}
+
+// Tells whether an entry of a directory is one of the directories in it
+static int isDirectoryFile(const struct cs1550_file_directory *file)
+{
+	return strcmp(file->fext, DIRECTORY_EXTENSION) == 0;
+}
+
+// Returns the bucket of the dentry cache holding the named directory of
+// parent, or the empty bucket where it would go
+static int findDentry(int parent, const char *name)
+{
+	cs1550_directory_cache *cache = &fs.directories;
+	int mask = cache->nDentryBuckets - 1;
+	int b = (nameHash(name, "") + (uint32_t)parent * 2654435761u) & mask;
+
+	while(cache->dentries[b].name[0] != '\0')
+	{
+		if(cache->dentries[b].parent == parent && strcmp(cache->dentries[b].name, name) == 0)
+			return b;
+		else;
+		b = (b + 1) & mask;
+	}
+	return b;
+}
+
+// Returns the cache slot of the first record of the directory with the given
+// name in parent, or -1 if there is none
+static int findDirectory(int parent, const char *name)
+{
+	cs1550_directory_cache *cache = &fs.directories;
+	int b;
+
+	if(cache->nDentryBuckets == 0)
+		return -1;
+	else;
+	b = findDentry(parent, name);
+	return cache->dentries[b].name[0] == '\0' ? -1 : cache->dentries[b].child;
+}
+
+// Adds a directory to the dentry cache, doubling its table first if it would
+// be more than half full
+static int addDentry(int parent, const char *name, int child)
+{
+	cs1550_directory_cache *cache = &fs.directories;
+	int b;
+
+	if(2 * (cache->nDentries + 1) > cache->nDentryBuckets)
+	{
+		cs1550_dentry *old = cache->dentries;
+		int nOld = cache->nDentryBuckets;
+		int nBuckets = nOld > 0 ? nOld * 2 : 64;
+		cs1550_dentry *dentries = calloc(nBuckets, sizeof(cs1550_dentry));
+		if(dentries == NULL)
+			return -ENOMEM;
+		else;
+		cache->dentries = dentries;
+		cache->nDentryBuckets = nBuckets;
+		for(b = 0; b < nOld; b++)
+		{
+			if(old[b].name[0] != '\0')
+				dentries[findDentry(old[b].parent, old[b].name)] = old[b];
+			else;
+		}
+		free(old);
+	}
+	else;
+
+	b = findDentry(parent, name);
+	if(cache->dentries[b].name[0] == '\0')
+		cache->nDentries++;
+	else;
+	cache->dentries[b].parent = parent;
+	cache->dentries[b].child = child;
+	strcpy(cache->dentries[b].name, name);
+	return 0;
+}
+
+// Walks path one directory at a time through the dentry cache, so nothing
+// but memory is looked at however deep it goes. Stores the slot of the first
+// record of the directory holding the last component in *parent, or
+// ROOT_DIRECTORY, and splits the last component into name and extension,
+// which is "" if it has none. Returns -ENOENT if a directory on the way
+// doesn't exist and -ENAMETOOLONG if the last component is over the 8.3
+// limit. The caller holds the namespace lock.
+static int walkPath(const char *path, int *parent, char *name, char *extension)
+{
+	const char *component = path + 1;
+	const char *end;
+	const char *dot;
+
+	*parent = ROOT_DIRECTORY;
+	if(path[0] != '/')
+		return -ENOENT;
+	else;
+	while((end = strchr(component, '/')) != NULL)
+	{
+		if(end - component > MAX_FILENAME)
+			return -ENOENT;
+		else;
+		memcpy(name, component, end - component);
+		name[end - component] = '\0';
+		*parent = findDirectory(*parent, name);
+		if(*parent < 0)
+			return -ENOENT;
+		else;
+		component = end + 1;
+	}
+
+	dot = strchr(component, '.');
+	if(dot == NULL)
+		dot = component + strlen(component);
+	else;
+	if(dot == component)
+		return -ENOENT;
+	else if(dot - component > MAX_FILENAME || (*dot != '\0' && strlen(dot + 1) > MAX_EXTENSION))
+		return -ENAMETOOLONG;
+	else;
+	memcpy(name, component, dot - component);
+	name[dot - component] = '\0';
+	strcpy(extension, *dot != '\0' ? dot + 1 : "");
+	return 0;
+}
+
+// Finds a file in the directory whose first record is in head. Returns the
+// slot of the record holding it and stores its index there in *index, or
+// returns -1 if there is none. extension is "" for a file without one.
+static int findFile(int head, const char *filename, const char *extension, int *index)
+{
+	cs1550_directory_index *dirIndex = fs.directories.indexes[head];
+	int b;
+
+	if(dirIndex->nBuckets == 0)
+		return -1;
+	else;
+	b = findBucket(dirIndex, filename, extension);
+	if(dirIndex->buckets[b] == 0)
+		return -1;
+	else;
+	*index = (dirIndex->buckets[b] - 1) % MAX_FILES_IN_DIR;
+	return (dirIndex->buckets[b] - 1) / MAX_FILES_IN_DIR;
+}
+
+// Adds the record in slot, which is already in the cache arrays, to its
+// directory, making the directory if this is its first record
+static int placeRecord(int slot)
+{
+	cs1550_directory_cache *cache = &fs.directories;
+	cs1550_directory_entry *entry = &cache->entries[slot];
+	cs1550_directory_index *index;
+	int head;
+	int i;
+	int res = 0;
+
+	if(entry->dname[0] == '/') // a directory below the root, named after its first record
+	{
+		head = atoi(entry->dname + 1);
+		if(head < 0 || head > slot || (head < slot && cache->indexes[head] == NULL))
+			return -EIO;
+		else;
+	}
+	else
+	{
+		head = findDirectory(ROOT_DIRECTORY, entry->dname);
+		if(head < 0)
+		{
+			int *directories = realloc(cache->directories, (cache->nDirectories + 1) * sizeof(int));
+			if(directories == NULL)
+				return -ENOMEM;
+			else;
+			cache->directories = directories;
+			res = addDentry(ROOT_DIRECTORY, entry->dname, slot);
+			if(res < 0)
+				return res;
+			else;
+			head = slot;
+			cache->directories[cache->nDirectories++] = head;
+		}
+		else;
+	}
+
+	if(head == slot)
+	{
+		cache->indexes[head] = newDirectoryIndex();
+		if(cache->indexes[head] == NULL)
+			return -ENOMEM;
+		else;
+	}
+	else;
+	index = cache->indexes[head];
+	cache->heads[slot] = head;
+
+	res = addRecord(index, slot);
+	for(i = 0; i < entry->nFiles && res == 0; i++)
+	{
+		res = indexFile(index, slot, i);
+		if(res == 0 && isDirectoryFile(&entry->files[i]))
+			res = addDentry(head, entry->files[i].fname, entry->files[i].nStartBlock);
+		else;
+	}
+	return res;
+}
+
+// Reads every record of .directories into the directory cache and groups
+// them into directories
+static int loadDirectories()
+{
+	cs1550_directory_cache *cache = &fs.directories;
+	struct stat st;
+	ssize_t bytes;
+	int i;
+	int res;
+
+	cache->entries = NULL;
+	cache->locks = NULL;
+	cache->maps = NULL;
+	cache->heads = NULL;
+	cache->indexes = NULL;
+	cache->directories = NULL;
+	cache->dentries = NULL;
+	cache->nRecords = 0;
+	cache->nDirectories = 0;
+	cache->nDentryBuckets = 0;
+	cache->nDentries = 0;
+	cache->capacity = 0;
+
+	if(fstat(fs.directoriesFd, &st) < 0)
+		return -EIO;
+	else;
+
+	cache->capacity = st.st_size / sizeof(cs1550_directory_entry);
+
+	if(cache->capacity > 0)
+	{
+		cache->entries = malloc(cache->capacity * sizeof(cs1550_directory_entry));
+		cache->locks = calloc(cache->capacity, sizeof(cs1550_directory_locks *));
+		cache->maps = calloc(cache->capacity * MAX_FILES_IN_DIR, sizeof(cs1550_extent_map));
+		cache->heads = malloc(cache->capacity * sizeof(int));
+		cache->indexes = calloc(cache->capacity, sizeof(cs1550_directory_index *));
+		if(cache->entries == NULL || cache->locks == NULL || cache->maps == NULL
+			|| cache->heads == NULL || cache->indexes == NULL)
+			return -ENOMEM;
+		else;
+		bytes = pread(fs.directoriesFd, cache->entries, cache->capacity * sizeof(cs1550_directory_entry), 0);
+		if(bytes < 0)
+			return -EIO;
+		else;
+		countIO(&fs.stats.directories, 0, bytes);
+		cache->nRecords = bytes / sizeof(cs1550_directory_entry);
+		for(i = 0; i < cache->nRecords; i++)
+		{
+			cache->locks[i] = newDirectoryLocks();
+			if(cache->locks[i] == NULL)
+				return -ENOMEM;
+			else;
+			res = placeRecord(i);
+			if(res < 0)
+				return res;
+			else;
+		}
+	}
+	else;
+
+	#if DEBUGFILE
+	printf("Loaded %d directories in %d records into the cache\n", cache->nDirectories, cache->nRecords);
+	#endif
+	return 0;
+}
+
+// Takes the namespace lock shared and the lock of the directory the record
+// in slot belongs to, exclusive if its files arrays are going to change
+static void lockDirectory(int slot, int exclusive)
+{
+	pthread_rwlock_rdlock(&fs.namespaceLock);
+	if(exclusive)
+		pthread_rwlock_wrlock(&fs.directories.locks[fs.directories.heads[slot]]->lock);
+	else
+		pthread_rwlock_rdlock(&fs.directories.locks[fs.directories.heads[slot]]->lock);
+}
+
+// Releases what lockDirectory took
+static void unlockDirectory(int slot)
+{
+	pthread_rwlock_unlock(&fs.directories.locks[fs.directories.heads[slot]]->lock);
+	pthread_rwlock_unlock(&fs.namespaceLock);
+}
+
+// Returns the lock for the data of the file at index in the record in slot
+static pthread_rwlock_t *fileLock(int slot, int index)
+{
+	return &fs.directories.locks[slot]->fileLocks[index];
+}
+
+// Finds the directory cache slot of the record holding the file a path names
+// and the file's index in it, and locks the directory the way lockDirectory
+// does. On success the caller releases it with unlockDirectory; on failure
+// nothing is left locked.
+static int resolvePath(const char *path, int *slot, int *index, int exclusive)
+{
+	char name[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	int parent;
+	int res;
+
+	pthread_rwlock_rdlock(&fs.namespaceLock);
+	res = walkPath(path, &parent, name, extension);
+	if(res == 0 && extension[0] == '\0' && findDirectory(parent, name) >= 0)
+		res = -EISDIR;
+	else if(res == 0 && parent == ROOT_DIRECTORY)
+		res = -ENOENT;
+	else;
+	pthread_rwlock_unlock(&fs.namespaceLock);
+	if(res < 0)
+		return res;
+	else;
+
+	//directories are never removed, so the slot is still good once locked
+	lockDirectory(parent, exclusive);
+	*slot = findFile(parent, name, extension, index);
+	if(*slot < 0)
+	{
+		unlockDirectory(parent);
+		return -ENOENT;
+	}
+	else;
+	return 0;
+}
+
+// Locks the directory of an open file shared and finds the file's current
+// index, which changes when unlink moves another file into its place. Files
+// never move to another record. A file created with the name after the
+// handle's file was removed has another generation and isn't found. On
+// success the caller releases it with unlockDirectory.
+static int lockHandle(cs1550_file_handle *handle, int *slot, int *index)
+{
+	cs1550_directory_entry *dir;
+	cs1550_extent_map *maps;
+	int i;
+
+	*slot = handle->slot;
+	lockDirectory(*slot, 0);
+	dir = &fs.directories.entries[*slot];
+	maps = &fs.directories.maps[*slot * MAX_FILES_IN_DIR];
+	pthread_mutex_lock(&handle->lock);
+	i = handle->index;
+	if(i >= dir->nFiles || strcmp(dir->files[i].fname, handle->fname) != 0 || strcmp(dir->files[i].fext, handle->fext) != 0
+		|| maps[i].generation != handle->generation)
+	{
+		if(findFile(fs.directories.heads[*slot], handle->fname, handle->fext, &i) != *slot
+			|| maps[i].generation != handle->generation)
+			i = -1;
+		else;
+		handle->index = i;
+	}
+	else;
+	pthread_mutex_unlock(&handle->lock);
+
+	if(i < 0)
+	{
+		unlockDirectory(*slot);
+		return -ENOENT;
+	}
+	else;
+	*index = i;
+	return 0;
+}
+
+// Writes one directory record in place in .directories
+static int writeRecord(long slot, const cs1550_directory_entry *entry)
+{
+	if(pwrite(fs.directoriesFd, entry, sizeof(cs1550_directory_entry),
+			(off_t)slot * sizeof(cs1550_directory_entry)) != sizeof(cs1550_directory_entry))
+		return -EIO;
+	else;
+	countIO(&fs.stats.directories, 1, sizeof(cs1550_directory_entry));
+	return 0;
+}
+
+// FNV-1a over a journal transaction
+static unsigned long journalChecksum(const char *data, long size)
+{
+	uint32_t hash = 2166136261u;
+	long i;
+
+	for(i = 0; i < size; i++)
+		hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+	return hash;
+}
+
+// Bytes a transaction of n records takes in the journal before padding
+static long transactionBytes(long n)
+{
+	return sizeof(cs1550_journal_header) + n * sizeof(cs1550_journal_record);
+}
+
+// Writes everything in the journal to .directories, syncs it and records in
+// block 0 that the journal now starts with the given transaction, so the
+// journal region can be written from the beginning again
+static int checkpointJournal(long sequence)
+{
+	int res = 0;
+
+	if(fsync(fs.directoriesFd) < 0)
+		return -EIO;
+	else;
+	countSync(&fs.stats.directories);
+	pthread_mutex_lock(&fs.allocatorLock);
+	fs.management.journalSequence = sequence;
+	if(writeDisk(0, &fs.management, sizeof(cs1550_disk_management)) < 0)
+		res = -EIO;
+	else;
+	pthread_mutex_unlock(&fs.allocatorLock);
+	if(res == 0 && fdatasync(fs.diskFd) < 0)
+		res = -EIO;
+	else;
+	if(res < 0)
+		return res;
+	else;
+	//the journal only starts over once block 0 has the new sequence on disk
+	countSync(&fs.stats.disk);
+	fs.journal.head = 0;
+	__sync_fetch_and_add(&fs.journal.checkpoints, 1);
+	return 0;
+}
+
+// Writes one transaction to the journal and syncs it, then writes its records
+// in place. Only the journal thread calls this. The journal is written through
+// the file even with -o mmap so that fdatasync covers it.
+static int writeTransaction(const cs1550_journal_record *records, long n, long sequence)
+{
+	cs1550_journal *journal = &fs.journal;
+	cs1550_journal_header *header = (cs1550_journal_header *)journal->buffer;
+	long bytes = transactionBytes(n);
+	long size = (bytes + fs.blockSize - 1) / fs.blockSize * fs.blockSize;
+	long i;
+	int res;
+
+	if(journal->head + size > fs.management.journalBlocks * fs.blockSize)
+	{
+		res = checkpointJournal(sequence);
+		if(res < 0)
+			return res;
+		else;
+	}
+	else;
+
+	header->magic = JOURNAL_MAGIC;
+	header->sequence = sequence;
+	header->nRecords = n;
+	header->checksum = 0;
+	memcpy(journal->buffer + sizeof(cs1550_journal_header), records, n * sizeof(cs1550_journal_record));
+	memset(journal->buffer + bytes, 0, size - bytes);
+	header->checksum = journalChecksum(journal->buffer, bytes);
+	if(pwrite(fs.diskFd, journal->buffer, size, (off_t)fs.management.journalStart * fs.blockSize + journal->head) != size
+		|| fdatasync(fs.diskFd) < 0)
+		return -EIO;
+	else;
+	countIO(&fs.stats.disk, 1, size);
+	countSync(&fs.stats.disk);
+	journal->head += size;
+
+	//the transaction is safe, so the records can go where they belong
+	for(i = 0; i < n; i++)
+	{
+		if(writeRecord(records[i].slot, &records[i].entry) < 0)
+			return -EIO;
+		else;
+	}
+	#if DEBUGFILE
+	printf("Committed journal transaction %ld with %ld records\n", sequence, n);
+	#endif
+	return 0;
+}
+
+// The journal thread. Commits the pending records whenever someone waits for
+// them, when there are JOURNAL_RECORDS of them or when JOURNAL_INTERVAL_MS
+// passes, and once more at unmount.
+static void *journalThread(void *arg)
+{
+	cs1550_journal *journal = &fs.journal;
+	(void) arg;
+
+	pthread_mutex_lock(&journal->lock);
+	while(!journal->stopping || journal->nPending > 0)
+	{
+		cs1550_journal_record *records;
+		long n;
+		long sequence;
+		int res;
+
+		if(!journal->stopping && (journal->nPending == 0
+			|| (journal->wanted < journal->sequence && journal->nPending < JOURNAL_RECORDS)))
+		{
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += JOURNAL_INTERVAL_MS * 1000000L;
+			if(deadline.tv_nsec >= 1000000000L)
+			{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			else;
+			if(pthread_cond_timedwait(&journal->work, &journal->lock, &deadline) != ETIMEDOUT || journal->nPending == 0)
+				continue;
+			else;
+		}
+		else;
+
+		//swap the buffers so records can be gathered while this one is written
+		records = journal->pending;
+		journal->pending = journal->committing;
+		journal->committing = records;
+		n = journal->nPending;
+		sequence = journal->sequence++;
+		journal->nPending = 0;
+		pthread_cond_broadcast(&journal->done);
+		pthread_mutex_unlock(&journal->lock);
+
+		res = writeTransaction(records, n, sequence);
+
+		pthread_mutex_lock(&journal->lock);
+		if(res < 0)
+			journal->error = res;
+		else;
+		journal->committed = sequence;
+		journal->commits++;
+		journal->records += n;
+		pthread_cond_broadcast(&journal->done);
+	}
+	pthread_mutex_unlock(&journal->lock);
+	return NULL;
+}
+
+// Waits until the transaction with the given number is on disk. 0 means
+// there is nothing to wait for.
+static int commitJournal(long sequence)
+{
+	cs1550_journal *journal = &fs.journal;
+	int res;
+
+	if(sequence <= 0)
+		return 0;
+	else;
+	pthread_mutex_lock(&journal->lock);
+	if(sequence > journal->wanted)
+		journal->wanted = sequence;
+	else;
+	pthread_cond_signal(&journal->work);
+	while(journal->committed < sequence)
+		pthread_cond_wait(&journal->done, &journal->lock);
+	res = journal->error;
+	pthread_mutex_unlock(&journal->lock);
+	return res;
+}
+
+// Waits until everything logged so far is on disk
+static int syncJournal()
+{
+	cs1550_journal *journal = &fs.journal;
+	long sequence;
+
+	if(!journal->active)
+		return 0;
+	else;
+	pthread_mutex_lock(&journal->lock);
+	sequence = journal->nPending > 0 ? journal->sequence : journal->committed;
+	pthread_mutex_unlock(&journal->lock);
+	return commitJournal(sequence);
+}
+
+// Logs the cached directory in the given slot for the next journal
+// transaction and returns that transaction's number, to be handed to
+// commitJournal by callers that need the record to be durable. Without a
+// journal the record is written in place and 0 is returned. The caller holds
+// the directory's lock. The record lock keeps the record still while it is
+// copied out and keeps two copies of it from being logged out of order.
+static long logDirectory(int slot)
+{
+	cs1550_journal *journal = &fs.journal;
+	pthread_mutex_t *recordLock = &fs.directories.locks[slot]->recordLock;
+	long sequence;
+	long i;
+
+	pthread_mutex_lock(recordLock);
+	if(!journal->active)
+	{
+		sequence = writeRecord(slot, &fs.directories.entries[slot]);
+		pthread_mutex_unlock(recordLock);
+		return sequence;
+	}
+	else;
+
+	pthread_mutex_lock(&journal->lock);
+	while(1)
+	{
+		//a record already waiting for this transaction is simply replaced
+		for(i = 0; i < journal->nPending && journal->pending[i].slot != slot; i++);
+		if(i < JOURNAL_RECORDS)
+			break;
+		else;
+		pthread_cond_signal(&journal->work);
+		pthread_cond_wait(&journal->done, &journal->lock);
+	}
+	if(i == journal->nPending)
+		journal->nPending++;
+	else;
+	journal->pending[i].slot = slot;
+	memcpy(&journal->pending[i].entry, &fs.directories.entries[slot], sizeof(cs1550_directory_entry));
+	sequence = journal->sequence;
+	if(journal->nPending == JOURNAL_RECORDS)
+		pthread_cond_signal(&journal->work);
+	else;
+	pthread_mutex_unlock(&journal->lock);
+	pthread_mutex_unlock(recordLock);
+	return sequence;
+}
+
+// Logs the cached directory in the given slot and waits until it is durable.
+// The caller holds the directory's lock.
+static int writeDirectory(int slot)
+{
+	long sequence = logDirectory(slot);
+
+	if(sequence < 0)
+		return sequence;
+	else;
+	return commitJournal(sequence);
+}
+
+// Writes every complete transaction left in the journal in place, before
+// anything reads .directories at mount. Transactions are numbered in order
+// from journalSequence, so replay stops at the first one that is missing,
+// torn or left over from before the journal last started over.
+static int replayJournal()
+{
+	cs1550_disk_management manage;
+	cs1550_journal_header header;
+	char *buffer;
+	off_t start;
+	long region;
+	long head = 0;
+	long sequence;
+	long i;
+	int res = 0;
+
+	if(readDisk(0, &manage, sizeof(cs1550_disk_management)) < 0)
+		return -EIO;
+	else if(manage.layout != LAYOUT_GEOMETRY || manage.journalStart <= 0 || manage.journalBlocks <= 0)
+		return 0;
+	else;
+	buffer = malloc(transactionBytes(JOURNAL_RECORDS));
+	if(buffer == NULL)
+		return -ENOMEM;
+	else;
+
+	start = (off_t)manage.journalStart * manage.blockSize;
+	region = manage.journalBlocks * manage.blockSize;
+	sequence = manage.journalSequence;
+	while(res == 0 && head + (long)sizeof(cs1550_journal_header) <= region)
+	{
+		cs1550_journal_record *records = (cs1550_journal_record *)(buffer + sizeof(cs1550_journal_header));
+		long bytes;
+
+		if(pread(fs.diskFd, &header, sizeof(cs1550_journal_header), start + head) != sizeof(cs1550_journal_header)
+			|| header.magic != JOURNAL_MAGIC || header.sequence != sequence
+			|| header.nRecords < 1 || header.nRecords > JOURNAL_RECORDS)
+			break;
+		else;
+		bytes = transactionBytes(header.nRecords);
+		if(head + bytes > region || pread(fs.diskFd, buffer, bytes, start + head) != bytes)
+			break;
+		else;
+		((cs1550_journal_header *)buffer)->checksum = 0;
+		if(journalChecksum(buffer, bytes) != header.checksum)
+			break;
+		else;
+
+		for(i = 0; i < header.nRecords && res == 0; i++)
+		{
+			if(records[i].slot < 0)
+				res = -EIO;
+			else
+				res = writeRecord(records[i].slot, &records[i].entry);
+		}
+		head += (bytes + manage.blockSize - 1) / manage.blockSize * manage.blockSize;
+		sequence++;
+	}
+	free(buffer);
+
+	if(res == 0 && sequence != manage.journalSequence)
+	{
+		fprintf(stderr, "cs1550: replayed %ld journal transactions\n", sequence - manage.journalSequence);
+		manage.journalSequence = sequence;
+		if(fsync(fs.directoriesFd) < 0 || writeDisk(0, &manage, sizeof(cs1550_disk_management)) < 0
+			|| fsync(fs.diskFd) < 0)
+			res = -EIO;
+		else;
+	}
+	else;
+	return res;
+}
+
+// Starts the journal thread once the disk is mounted
+static int startJournal()
+{
+	cs1550_journal *journal = &fs.journal;
+
+	if(fs.management.journalStart <= 0)
+		return 0;
+	else;
+	journal->pending = malloc(JOURNAL_RECORDS * sizeof(cs1550_journal_record));
+	journal->committing = malloc(JOURNAL_RECORDS * sizeof(cs1550_journal_record));
+	journal->buffer = malloc((transactionBytes(JOURNAL_RECORDS) + fs.blockSize - 1) / fs.blockSize * fs.blockSize);
+	if(journal->pending == NULL || journal->committing == NULL || journal->buffer == NULL)
+		return -ENOMEM;
+	else;
+	journal->nPending = 0;
+	journal->stopping = 0;
+	journal->error = 0;
+	journal->head = 0;
+	journal->sequence = fs.management.journalSequence;
+	journal->committed = journal->sequence - 1;
+	journal->wanted = journal->committed;
+	if(pthread_create(&journal->thread, NULL, journalThread, NULL) != 0)
+		return -EAGAIN;
+	else;
+	journal->active = 1;
+	return 0;
+}
+
+// Commits what is left in the journal and stops its thread. Everything in it
+// is then synced in place, so the next mount has nothing to replay.
+static int stopJournal()
+{
+	cs1550_journal *journal = &fs.journal;
+	int res;
+
+	if(!journal->active)
+		return 0;
+	else;
+	pthread_mutex_lock(&journal->lock);
+	journal->stopping = 1;
+	pthread_cond_signal(&journal->work);
+	pthread_mutex_unlock(&journal->lock);
+	pthread_join(journal->thread, NULL);
+	journal->active = 0;
+
+	res = journal->error;
+	if(res == 0 && fsync(fs.directoriesFd) < 0)
+		res = -EIO;
+	else if(res == 0)
+	{
+		pthread_mutex_lock(&fs.allocatorLock);
+		fs.management.journalSequence = journal->sequence;
+		pthread_mutex_unlock(&fs.allocatorLock);
+	}
+	else;
+	free(journal->pending);
+	free(journal->committing);
+	free(journal->buffer);
+	journal->pending = NULL;
+	journal->committing = NULL;
+	journal->buffer = NULL;
+	return res;
+}
+
+// Adds an empty record named directory to the end of the cache and of
+// .directories: the first record of a new directory, or another one for a
+// directory whose records are all full. Returns the new slot or a negative
+// error. The caller holds the namespace lock exclusively.
+static int appendRecord(const char *directory)
+{
+	cs1550_directory_cache *cache = &fs.directories;
+	cs1550_directory_entry *newRecord;
+	int res;
+
+	if(cache->nRecords == cache->capacity)
+	{
+		int capacity = cache->capacity > 0 ? cache->capacity * 2 : 16;
+		cs1550_directory_entry *entries = realloc(cache->entries, capacity * sizeof(cs1550_directory_entry));
+		cs1550_directory_locks **locks;
+		cs1550_extent_map *maps;
+		cs1550_directory_index **indexes;
+		int *heads;
+		if(entries == NULL)
+			return -ENOMEM;
+		else;
+		cache->entries = entries;
+		locks = realloc(cache->locks, capacity * sizeof(cs1550_directory_locks *));
+		if(locks == NULL)
+			return -ENOMEM;
+		else;
+		memset(locks + cache->capacity, 0, (capacity - cache->capacity) * sizeof(cs1550_directory_locks *));
+		cache->locks = locks;
+		maps = realloc(cache->maps, capacity * MAX_FILES_IN_DIR * sizeof(cs1550_extent_map));
+		if(maps == NULL)
+			return -ENOMEM;
+		else;
+		memset(maps + cache->capacity * MAX_FILES_IN_DIR, 0,
+			(capacity - cache->capacity) * MAX_FILES_IN_DIR * sizeof(cs1550_extent_map));
+		cache->maps = maps;
+		heads = realloc(cache->heads, capacity * sizeof(int));
+		if(heads == NULL)
+			return -ENOMEM;
+		else;
+		cache->heads = heads;
+		indexes = realloc(cache->indexes, capacity * sizeof(cs1550_directory_index *));
+		if(indexes == NULL)
+			return -ENOMEM;
+		else;
+		memset(indexes + cache->capacity, 0, (capacity - cache->capacity) * sizeof(cs1550_directory_index *));
+		cache->indexes = indexes;
+		cache->capacity = capacity;
+	}
+	else;
+
+	if(cache->locks[cache->nRecords] == NULL)
+		cache->locks[cache->nRecords] = newDirectoryLocks();
+	else;
+	if(cache->locks[cache->nRecords] == NULL)
+		return -ENOMEM;
+	else;
+
+	newRecord = &cache->entries[cache->nRecords];
+	memset(newRecord, 0, sizeof(cs1550_directory_entry));
+	strcpy(newRecord->dname, directory);
+	newRecord->nFiles = 0;
+
+	res = writeDirectory(cache->nRecords);
+	if(res == 0)
+		res = placeRecord(cache->nRecords);
+	else;
+	if(res < 0)
+		return res;
+	else;
+
+	return cache->nRecords++;
+}
+
+// Marks count blocks from start as used or free in the in-memory bitmap and
+// remembers which bitmap blocks will have to be written out
+static void markBlocks(long start, long count, int used)
+{
+	cs1550_allocator *allocator = &fs.allocator;
+	long block;
+
+	for(block = start; block < start + count; block++)
+	{
+		unsigned char bit = 1 << (block % 8);
+		if(((allocator->bitmap[block / 8] & bit) != 0) == used)
+			continue;
+		else if(used)
+		{
+			allocator->bitmap[block / 8] |= bit;
+			allocator->nFree--;
+		}
+		else
+		{
+			allocator->bitmap[block / 8] &= ~bit;
+			allocator->nFree++;
+		}
+		allocator->dirty[block / (8 * fs.blockSize)] = 1;
+	}
+}
+
+// Returns whether a block is marked as used in the bitmap
+static int blockInUse(long block)
+{
+	return (fs.allocator.bitmap[block / 8] >> (block % 8)) & 1;
+}
+
+// Looks for count free blocks in a row, starting where the last allocation
+// left off and wrapping around to the start of the disk. If there is no run
+// that long the longest one seen is taken instead. The run is marked as used,
+// its first block is stored in *start and its length is returned, or
+// -ENOSPC if the disk is full. The caller holds the allocator lock.
+static long findFreeBlocks(long count, long *start)
+{
+	cs1550_allocator *allocator = &fs.allocator;
+	long bestStart = -1;
+	long bestLength = 0;
+	long block = allocator->cursor;
+	long scanned = 0;
+
+	#if DEBUGALLOCATE
+	printf("Allocating %ld blocks, %ld free\n", count, allocator->nFree);
+	#endif
+	if(allocator->nFree == 0)
+		return -ENOSPC;
+	else;
+
+	while(scanned < fs.nBlocks && bestLength < count)
+	{
+		long runStart;
+
+		if(block >= fs.nBlocks) // wrap around, a run can't span the end of the disk
+		{
+			block = 1;
+			continue;
+		}
+		else if(block % 8 == 0 && allocator->bitmap[block / 8] == 0xFF) // skip full bytes quickly
+		{
+			block += 8;
+			scanned += 8;
+			continue;
+		}
+		else if(blockInUse(block))
+		{
+			block++;
+			scanned++;
+			continue;
+		}
+		else;
+
+		runStart = block;
+		while(block < fs.nBlocks && block - runStart < count && !blockInUse(block))
+			block++;
+		scanned += block - runStart;
+		if(block - runStart > bestLength)
+		{
+			bestStart = runStart;
+			bestLength = block - runStart;
+		}
+		else;
+	}
+
+	if(bestLength == 0)
+		return -ENOSPC;
+	else;
+	markBlocks(bestStart, bestLength, 1);
+	allocator->cursor = bestStart + bestLength;
+	__sync_fetch_and_add(&fs.stats.allocations, 1);
+	__sync_fetch_and_add(&fs.stats.allocatedBlocks, bestLength);
+	*start = bestStart;
+	#if DEBUGALLOCATE
+	printf("Allocated %ld blocks at %ld\n", bestLength, bestStart);
+	#endif
+	return bestLength;
+}
+
+// findFreeBlocks under the allocator lock
+static long allocateBlocks(long count, long *start)
+{
+	long res;
+
+	pthread_mutex_lock(&fs.allocatorLock);
+	res = findFreeBlocks(count, start);
+	pthread_mutex_unlock(&fs.allocatorLock);
+	return res;
+}
+
+// Gives whatever a pool still has reserved back to the bitmap. The caller
+// holds the pool's lock.
+static void returnPool(cs1550_allocation_pool *pool)
+{
+	if(pool->nBlocks == 0)
+		return;
+	else;
+	#if DEBUGALLOCATE
+	printf("Returning %ld reserved blocks at %ld\n", pool->nBlocks, pool->start);
+	#endif
+	pthread_mutex_lock(&fs.allocatorLock);
+	markBlocks(pool->start, pool->nBlocks, 0);
+	pthread_mutex_unlock(&fs.allocatorLock);
+	__sync_fetch_and_add(&fs.stats.frees, 1);
+	__sync_fetch_and_add(&fs.stats.freedBlocks, pool->nBlocks);
+	pool->nBlocks = 0;
+	pool->returns++;
+}
+
+// Empties every pool, one at a time so no two pool locks are ever held at once
+static void returnPools()
+{
+	int i;
+
+	for(i = 0; i < ALLOCATION_POOLS; i++)
+	{
+		pthread_mutex_lock(&fs.pools[i].lock);
+		returnPool(&fs.pools[i]);
+		pthread_mutex_unlock(&fs.pools[i].lock);
+	}
+}
+
+// Hands out up to count blocks in a row from the current thread's pool,
+// reserving another batch from the bitmap when the pool can't cover the
+// request. Works like allocateBlocks: the first block goes in *start and the
+// number of blocks is returned, or -ENOSPC. Big requests go straight to
+// allocateBlocks, and so does a request the pool can't refill for, after
+// every pool has given back what it was holding.
+static long poolAllocate(long count, long *start)
+{
+	cs1550_allocation_pool *pool;
+	long res;
+
+	if(count >= POOL_BATCH)
+		return allocateBlocks(count, start);
+	else;
+	if(poolIndex < 0)
+		poolIndex = __sync_fetch_and_add(&fs.nextPool, 1) % ALLOCATION_POOLS;
+	else;
+	pool = &fs.pools[poolIndex];
+
+	pthread_mutex_lock(&pool->lock);
+	if(pool->nBlocks < count)
+	{
+		returnPool(pool);
+		res = allocateBlocks(POOL_BATCH, &pool->start);
+		if(res > 0)
+		{
+			pool->nBlocks = res;
+			pool->refills++;
+		}
+		else;
+	}
+	else;
+	if(pool->nBlocks == 0)
+	{
+		//other pools may be sitting on the last free blocks
+		pthread_mutex_unlock(&pool->lock);
+		returnPools();
+		return allocateBlocks(count, start);
+	}
+	else;
+	res = pool->nBlocks < count ? pool->nBlocks : count;
+	*start = pool->start;
+	pool->start += res;
+	pool->nBlocks -= res;
+	pool->allocations++;
+	pool->blocks += res;
+	pthread_mutex_unlock(&pool->lock);
+	return res;
+}
+
+// Allocates a single block, returning its number or -1 if the disk is full
+static long allocateDisk()
+{
+	long block;
+
+	if(poolAllocate(1, &block) < 1)
+		return -1;
+	else;
+	return block;
+}
+
+// Gives a run of blocks back to the free space
+static void freeRun(long start, long count)
+{
+	long block;
+
+	#if DEBUGALLOCATE
+	printf("Freeing %ld blocks at %ld\n", count, start);
+	#endif
+	invalidateBlocks(start, count);
+	//nobody can have the blocks again until they are marked free below
+	for(block = start; block < start + count; block++)
+	{
+		if(summedBlock(block))
+		{
+			storeSum(block, 0);
+			setBlockBit(fs.checksums.changed, block, 0);
+		}
+		else;
+	}
+	pthread_mutex_lock(&fs.allocatorLock);
+	markBlocks(start, count, 0);
+	pthread_mutex_unlock(&fs.allocatorLock);
+	__sync_fetch_and_add(&fs.stats.frees, 1);
+	__sync_fetch_and_add(&fs.stats.freedBlocks, count);
+}
+
+// Where a block's entry goes in the shared block table before probing
+static long sharedHome(long block)
+{
+	return (block * 2654435761UL) & (fs.dedup.sharedSlots - 1);
+}
+
+// Returns the slot of the shared block table holding block, or the empty
+// slot where it would go. The caller holds the dedup lock.
+static long sharedSlot(long block)
+{
+	long mask = fs.dedup.sharedSlots - 1;
+	long s = sharedHome(block);
+
+	while(fs.dedup.shared[s].block != 0 && fs.dedup.shared[s].block != block)
+		s = (s + 1) & mask;
+	return s;
+}
+
+// Returns how many extents use a block if it is shared, 0 if only one does.
+// The caller holds the dedup lock.
+static long blockReferences(long block)
+{
+	if(fs.dedup.nShared == 0)
+		return 0;
+	else;
+	return fs.dedup.shared[sharedSlot(block)].references;
+}
+
+// Counts one more extent using a block something already uses. The table
+// doubles when it is half full. The caller holds the dedup lock.
+static int addReference(long block)
+{
+	cs1550_dedup *dedup = &fs.dedup;
+	long s;
+
+	if((dedup->nShared + 1) * 2 > dedup->sharedSlots)
+	{
+		cs1550_shared_block *old = dedup->shared;
+		long oldSlots = dedup->sharedSlots;
+		long slots = oldSlots > 0 ? oldSlots * 2 : DEDUP_MIN_SLOTS;
+		cs1550_shared_block *shared = calloc(slots, sizeof(cs1550_shared_block));
+		if(shared == NULL)
+			return -ENOMEM;
+		else;
+		dedup->shared = shared;
+		dedup->sharedSlots = slots;
+		for(s = 0; s < oldSlots; s++)
+		{
+			if(old[s].block != 0)
+				shared[sharedSlot(old[s].block)] = old[s];
+			else;
+		}
+		free(old);
+	}
+	else;
+	s = sharedSlot(block);
+	if(dedup->shared[s].block == 0)
+	{
+		dedup->shared[s].block = block;
+		dedup->shared[s].references = 1;
+		dedup->nShared++;
+	}
+	else;
+	dedup->shared[s].references++;
+	return 0;
+}
+
+// Counts one less extent using a block. Returns 1 if another extent still
+// uses it and 0 if it wasn't shared, so it can be freed. A block left with
+// one user leaves the table, and later entries of the same run of full
+// slots move back into the hole when that is nearer their own slot, as in
+// unindexFile. The caller holds the dedup lock.
+static int dropReference(long block)
+{
+	cs1550_dedup *dedup = &fs.dedup;
+	long mask = dedup->sharedSlots - 1;
+	long hole;
+	long s;
+
+	if(dedup->nShared == 0)
+		return 0;
+	else;
+	hole = sharedSlot(block);
+	if(dedup->shared[hole].block == 0)
+		return 0;
+	else if(--dedup->shared[hole].references > 1)
+		return 1;
+	else;
+	dedup->shared[hole].block = 0;
+	dedup->shared[hole].references = 0;
+	dedup->nShared--;
+	for(s = (hole + 1) & mask; dedup->shared[s].block != 0; s = (s + 1) & mask)
+	{
+		long home = sharedHome(dedup->shared[s].block);
+		if(((s - home) & mask) >= ((s - hole) & mask))
+		{
+			dedup->shared[hole] = dedup->shared[s];
+			dedup->shared[s].block = 0;
+			dedup->shared[s].references = 0;
+			hole = s;
+		}
+		else;
+	}
+	return 1;
+}
+
+// Forgets a block's entry in the dedup index, because its data is about to
+// change or it is being let go. The caller holds the dedup lock.
+static void unindexBlock(long block)
+{
+	if(fs.dedup.indexed != NULL)
+		fs.dedup.indexed[block / 8] &= ~(1 << (block % 8));
+	else;
+}
+
+// Gives blocks back to the free space. With dedup a shared block only loses
+// one of its users instead, so the blocks are freed in the runs between them.
+static void freeBlocks(long start, long count)
+{
+	long run = start;
+	long block;
+
+	if(!fs.dedup.active)
+	{
+		freeRun(start, count);
+		return;
+	}
+	else;
+	pthread_mutex_lock(&fs.dedup.lock);
+	for(block = start; block < start + count; block++)
+	{
+		if(dropReference(block))
+		{
+			if(block > run)
+				freeRun(run, block - run);
+			else;
+			run = block + 1;
+		}
+		else
+			unindexBlock(block);
+	}
+	if(block > run)
+		freeRun(run, block - run);
+	else;
+	pthread_mutex_unlock(&fs.dedup.lock);
+}
+
+// Starts the in-memory bitmap over with only block 0 in use
+static int resetAllocator()
+{
+	cs1550_allocator *allocator = &fs.allocator;
+
+	free(allocator->bitmap);
+	free(allocator->dirty);
+	allocator->bitmap = calloc(fs.bitmapBlocks * fs.blockSize, 1);
+	allocator->dirty = calloc(fs.bitmapBlocks, 1);
+	if(allocator->bitmap == NULL || allocator->dirty == NULL)
+		return -ENOMEM;
+	else;
+	allocator->nFree = fs.nBlocks;
+	allocator->cursor = 1;
+	markBlocks(0, 1, 1);
+	return 0;
+}
+
+// Returns how many file blocks an extent holds
+static long fileBlocksOf(const cs1550_extent *extent)
+{
+	return extent->nBlocks < 0 ? fs.compressBlocks : extent->nBlocks;
+}
+
+// Says whether an extent is a hole. Block 0 is the disk management block,
+// so no other extent starts there.
+static int isHole(const cs1550_extent *extent)
+{
+	return extent->nStartBlock == 0;
+}
+
+// Returns how many blocks an extent takes on disk
+static long diskBlocksOf(const cs1550_extent *extent)
+{
+	if(isHole(extent))
+		return 0;
+	else;
+	return extent->nBlocks < 0 ? -extent->nBlocks : extent->nBlocks;
+}
+
+// Frees the memory held by an extent map. The generation stays, since it
+// belongs to the file and not to its extents.
+static void freeExtentMap(cs1550_extent_map *map)
+{
+	unsigned long generation = map->generation;
+
+	free(map->extents);
+	free(map->fileBlocks);
+	free(map->extentBlocks);
+	free(map->inlineData);
+	memset(map, 0, sizeof(cs1550_extent_map));
+	map->generation = generation;
+}
+
+// Makes room for at least n extents in a file's map. The arrays at least
+// double each time, so a file that keeps growing rarely goes to realloc.
+static int growExtents(cs1550_extent_map *map, long n)
+{
+	long capacity = map->capacity > 0 ? map->capacity * 2 : 4;
+	cs1550_extent *extents;
+	long *fileBlocks;
+
+	if(n <= map->capacity)
+		return 0;
+	else;
+	if(capacity < n)
+		capacity = n;
+	else;
+	extents = realloc(map->extents, capacity * sizeof(cs1550_extent));
+	if(extents == NULL)
+		return -ENOMEM;
+	else;
+	map->extents = extents;
+	fileBlocks = realloc(map->fileBlocks, capacity * sizeof(long));
+	if(fileBlocks == NULL)
+		return -ENOMEM;
+	else;
+	map->fileBlocks = fileBlocks;
+	map->capacity = capacity;
+	return 0;
+}
+
+// Makes room for one more extent block in a file's map, doubling the array
+// when it is full
+static int growExtentBlocks(cs1550_extent_map *map)
+{
+	long capacity = map->extentBlocksCapacity > 0 ? map->extentBlocksCapacity * 2 : 1;
+	long *extentBlocks;
+
+	if(map->nExtentBlocks < map->extentBlocksCapacity)
+		return 0;
+	else;
+	extentBlocks = realloc(map->extentBlocks, capacity * sizeof(long));
+	if(extentBlocks == NULL)
+		return -ENOMEM;
+	else;
+	map->extentBlocks = extentBlocks;
+	map->extentBlocksCapacity = capacity;
+	return 0;
+}
+
+// Returns the extent map for a file, reading its extent blocks if this is
+// the first time the file has been touched since mount
+static cs1550_extent_map *getExtentMap(int slot, int index)
+{
+	cs1550_extent_map *map = &fs.directories.maps[slot * MAX_FILES_IN_DIR + index];
+	long nextBlock = fs.directories.entries[slot].files[index].nStartBlock;
+	cs1550_extent_block *block;
+	int failed = 0;
+	long i;
+
+	if(map->loaded)
+		return map;
+	else;
+	block = arenaPush(fs.blockSize);
+	if(block == NULL)
+		return NULL;
+	else;
+
+	#if DEBUGFILEREAD
+	printf("Loading extent list starting at block %ld\n", nextBlock);
+	#endif
+	while(nextBlock > 0 && !failed)
+	{
+		//a chain longer than the disk has blocks must loop back on itself
+		if(growExtentBlocks(map) < 0 || nextBlock >= fs.nBlocks || map->nExtentBlocks >= fs.nBlocks
+			|| readBlock(nextBlock, block) < 0 || block->nExtents > fs.extentsPerBlock)
+		{
+			failed = 1;
+			break;
+		}
+		else;
+		map->extentBlocks[map->nExtentBlocks++] = nextBlock;
+
+		//a small file's data is kept in memory with its map
+		if(block->nExtents == INLINE_EXTENTS)
+		{
+			map->inlineData = malloc(fs.inlineBytes);
+			if(map->inlineData == NULL)
+				failed = 1;
+			else
+				memcpy(map->inlineData, block->extents, fs.inlineBytes);
+			break;
+		}
+		else if(growExtents(map, map->nExtents + block->nExtents) < 0)
+		{
+			failed = 1;
+			break;
+		}
+		else;
+
+		for(i = 0; i < block->nExtents; i++)
+		{
+			//a damaged list mustn't send reads and frees off the disk
+			if(block->extents[i].nStartBlock < 0 || (isHole(&block->extents[i]) && block->extents[i].nBlocks <= 0)
+				|| block->extents[i].nStartBlock + diskBlocksOf(&block->extents[i]) > fs.nBlocks)
+			{
+				failed = 1;
+				break;
+			}
+			else;
+			map->extents[map->nExtents] = block->extents[i];
+			map->fileBlocks[map->nExtents] = map->nBlocks;
+			map->nBlocks += fileBlocksOf(&block->extents[i]);
+			map->nExtents++;
+		}
+		nextBlock = block->nNextBlock;
+	}
+	arenaPop(fs.blockSize);
+	//drop what was read so the next try starts from an empty map
+	if(failed)
+	{
+		freeExtentMap(map);
+		return NULL;
+	}
+	else;
+	map->dirtyFrom = MAP_SAVED;
+	map->compressFrom = map->nBlocks;
+	map->dedupFrom = map->nBlocks;
+	map->loaded = 1;
+	return map;
+}
+
+// Returns the index of the extent holding the given file block, which must be
+// less than map->nBlocks
+static long findExtent(cs1550_extent_map *map, long fileBlock)
+{
+	long low = 0;
+	long high = map->nExtents - 1;
+
+	while(low < high)
+	{
+		long middle = (low + high + 1) / 2;
+		if(map->fileBlocks[middle] <= fileBlock)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+	return low;
+}
+
+// Brings count blocks of a file starting at file block first into the block
+// cache, one extent at a time
+static int readAhead(cs1550_extent_map *map, long first, long count)
+{
+	if(first + count > map->nBlocks)
+		count = map->nBlocks - first;
+	else;
+
+	while(count > 0)
+	{
+		long k = findExtent(map, first);
+		long inExtent = first - map->fileBlocks[k];
+		long n = fileBlocksOf(&map->extents[k]) - inExtent;
+		int res;
+
+		if(n > count)
+			n = count;
+		else;
+		//a compressed unit is read whole, and a hole has nothing to read
+		if(isHole(&map->extents[k]))
+			res = 0;
+		else if(map->extents[k].nBlocks < 0)
+			res = fillCache(map->extents[k].nStartBlock, diskBlocksOf(&map->extents[k]));
+		else
+			res = fillCache(map->extents[k].nStartBlock + inExtent, n);
+		if(res < 0)
+			return -EIO;
+		else;
+		first += n;
+		count -= n;
+	}
+	return 0;
+}
+
+// Adds count blocks starting at block to the end of a file, growing the last
+// extent when they come straight after it on disk. Block 0 adds a hole.
+static int appendExtent(cs1550_extent_map *map, long block, long count)
+{
+	cs1550_extent *last = map->nExtents > 0 ? &map->extents[map->nExtents - 1] : NULL;
+
+	if(last != NULL && (isHole(last) ? block == 0
+		: block > 0 && last->nBlocks > 0 && last->nStartBlock + last->nBlocks == block))
+	{
+		last->nBlocks += count;
+		if(map->dirtyFrom > map->nExtents - 1)
+			map->dirtyFrom = map->nExtents - 1;
+		else;
+	}
+	else
+	{
+		if(growExtents(map, map->nExtents + 1) < 0)
+			return -ENOMEM;
+		else;
+		map->extents[map->nExtents].nStartBlock = block;
+		map->extents[map->nExtents].nBlocks = count;
+		map->fileBlocks[map->nExtents] = map->nBlocks;
+		if(map->dirtyFrom > map->nExtents)
+			map->dirtyFrom = map->nExtents;
+		else;
+		map->nExtents++;
+	}
+	map->nBlocks += count;
+	return 0;
+}
+
+// Writes the extents that changed since the last call out to the file's
+// extent blocks, allocating another extent block when the list outgrows them.
+// The caller records map->extentBlocks[0] as the file's nStartBlock.
+static int saveExtentMap(cs1550_extent_map *map)
+{
+	cs1550_extent_block *block;
+	long needed = (map->nExtents + fs.extentsPerBlock - 1) / fs.extentsPerBlock;
+	long first = map->dirtyFrom / fs.extentsPerBlock;
+	long i;
+
+	if(map->dirtyFrom == MAP_SAVED) // nothing changed
+		return 0;
+	else;
+
+	while(map->nExtentBlocks < needed)
+	{
+		long newBlock;
+		if(growExtentBlocks(map) < 0)
+			return -ENOMEM;
+		else;
+		newBlock = allocateDisk();
+		if(newBlock < 0)
+			return -ENOSPC;
+		else;
+		map->extentBlocks[map->nExtentBlocks++] = newBlock;
+		if(map->nExtentBlocks > 1 && first > map->nExtentBlocks - 2) // the previous block has to point at the new one
+			first = map->nExtentBlocks - 2;
+		else;
+	}
+
+	block = arenaPush(fs.blockSize);
+	if(block == NULL)
+		return -ENOMEM;
+	else;
+	for(i = first; i < map->nExtentBlocks; i++)
+	{
+		long start = i * fs.extentsPerBlock;
+		long count = map->nExtents - start;
+		if(count > fs.extentsPerBlock)
+			count = fs.extentsPerBlock;
+		else if(count < 0)
+			count = 0;
+		else;
+
+		memset(block, 0, fs.blockSize);
+		block->nExtents = count;
+		block->nNextBlock = i + 1 < map->nExtentBlocks ? map->extentBlocks[i + 1] : 0;
+		memcpy(block->extents, map->extents + start, count * sizeof(cs1550_extent));
+		if(writeBlock(map->extentBlocks[i], block) < 0)
+		{
+			arenaPop(fs.blockSize);
+			return -EIO;
+		}
+		else;
+	}
+	arenaPop(fs.blockSize);
+	map->dirtyFrom = MAP_SAVED;
+	return 0;
+}
+
+// Writes a small file's data out to its extent block
+static int saveInline(cs1550_extent_map *map)
+{
+	cs1550_extent_block *block = arenaPush(fs.blockSize);
+	int res;
+
+	if(block == NULL)
+		return -ENOMEM;
+	else;
+	block->nExtents = INLINE_EXTENTS;
+	block->nNextBlock = 0;
+	memcpy(block->extents, map->inlineData, fs.inlineBytes);
+	res = writeBlock(map->extentBlocks[0], block) < 0 ? -EIO : 0;
+	arenaPop(fs.blockSize);
+	return res;
+}
+
+// Starts keeping an empty file's data in its extent block, allocating the
+// extent block if the file has none yet
+static int makeInline(cs1550_extent_map *map)
+{
+	if(map->nExtentBlocks == 0)
+	{
+		long newBlock;
+		if(growExtentBlocks(map) < 0)
+			return -ENOMEM;
+		else;
+		newBlock = allocateDisk();
+		if(newBlock < 0)
+			return -ENOSPC;
+		else;
+		map->extentBlocks[map->nExtentBlocks++] = newBlock;
+	}
+	else;
+	map->inlineData = calloc(1, fs.inlineBytes);
+	return map->inlineData == NULL ? -ENOMEM : 0;
+}
+
+// Moves the size bytes of a small file's data out of its extent block into a
+// data block of their own, so the file can grow past fs.inlineBytes. The data
+// block is written straight to .disk because the extent block is rewritten
+// as an extent list as soon as anything more is written.
+static int promoteInline(cs1550_extent_map *map, long size)
+{
+	int res = 0;
+
+	if(size > 0)
+	{
+		char *data = arenaPush(fs.blockSize);
+		long newBlock;
+		if(data == NULL)
+			return -ENOMEM;
+		else;
+		newBlock = allocateDisk();
+		memset(data + size, 0, fs.blockSize - size);
+		memcpy(data, map->inlineData, size);
+		if(newBlock < 0)
+			res = -ENOSPC;
+		else if(writeBlock(newBlock, data) < 0)
+			res = -EIO;
+		else
+			res = appendExtent(map, newBlock, 1);
+		arenaPop(fs.blockSize);
+		if(res < 0)
+			return res;
+		else;
+	}
+	else;
+	free(map->inlineData);
+	map->inlineData = NULL;
+	map->dirtyFrom = 0;
+	return 0;
+}
+
+// Writes the bytes that follow a token for a length of 15 or more, 255 in
+// each until what is left is less than that
+static long putLength(unsigned char *out, long used, long length)
+{
+	if(length < 15)
+		return used;
+	else;
+	length -= 15;
+	while(length >= 255)
+	{
+		out[used++] = 255;
+		length -= 255;
+	}
+	out[used++] = length;
+	return used;
+}
+
+// Appends one sequence of lzCompress to out at used. A matchLength of 0 makes
+// it the last sequence, which has no match. Returns where the next one goes,
+// or -1 if it doesn't fit in capacity.
+static long putSequence(unsigned char *out, long used, long capacity, const unsigned char *literals,
+	long nLiterals, long offset, long matchLength)
+{
+	long extra = matchLength > 0 ? matchLength - COMPRESS_MIN_MATCH : 0;
+
+	if(used < 0 || used + 1 + nLiterals / 255 + 1 + nLiterals + 2 + extra / 255 + 1 > capacity)
+		return -1;
+	else;
+	out[used++] = (nLiterals < 15 ? nLiterals : 15) << 4 | (extra < 15 ? extra : 15);
+	used = putLength(out, used, nLiterals);
+	memcpy(out + used, literals, nLiterals);
+	used += nLiterals;
+	if(matchLength > 0)
+	{
+		out[used++] = offset & 0xFF;
+		out[used++] = offset >> 8;
+		used = putLength(out, used, extra);
+	}
+	else;
+	return used;
+}
+
+// Compresses size bytes of in into out in the style of LZ4: a list of
+// sequences, each a token, some literal bytes and a match that copies bytes
+// from earlier in the output. The high half of the token is how many
+// literals there are and the low half the match length less
+// COMPRESS_MIN_MATCH, with 15 meaning more length bytes follow. The match
+// offset is two bytes, low byte first. The last sequence has no match.
+// Returns the compressed size, or -1 if it would be more than capacity.
+static long lzCompress(const unsigned char *in, long size, unsigned char *out, long capacity)
+{
+	uint32_t table[1 << COMPRESS_HASH_BITS];
+	long anchor = 0;
+	long position = 0;
+	long used = 0;
+
+	memset(table, 0, sizeof(table));
+	while(position + COMPRESS_MIN_MATCH <= size)
+	{
+		uint32_t word;
+		uint32_t hash;
+		long candidate;
+		long length;
+
+		memcpy(&word, in + position, sizeof(word));
+		hash = (word * 2654435761U) >> (32 - COMPRESS_HASH_BITS);
+		candidate = table[hash];
+		table[hash] = position;
+		if(candidate >= position || position - candidate > 0xFFFF
+			|| memcmp(in + candidate, in + position, COMPRESS_MIN_MATCH) != 0)
+		{
+			//the longer nothing matches the faster the data is skipped
+			position += 1 + ((position - anchor) >> 6);
+			continue;
+		}
+		else;
+		length = COMPRESS_MIN_MATCH;
+		while(position + length < size && in[candidate + length] == in[position + length])
+			length++;
+		used = putSequence(out, used, capacity, in + anchor, position - anchor, position - candidate, length);
+		if(used < 0)
+			return -1;
+		else;
+		position += length;
+		anchor = position;
+	}
+	return putSequence(out, used, capacity, in + anchor, size - anchor, 0, 0);
+}
+
+// Reads the length bytes that follow a token at *position when length, from
+// the token, is 15. Returns -1 if they run past the end of in.
+static long getLength(const unsigned char *in, long size, long *position, long length)
+{
+	unsigned char byte;
+
+	if(length < 15)
+		return length;
+	else;
+	do
+	{
+		if(*position >= size)
+			return -1;
+		else;
+		byte = in[(*position)++];
+		length += byte;
+	} while(byte == 255);
+	return length;
+}
+
+// Undoes lzCompress. Returns how many bytes went into out, or -1 if in isn't
+// something lzCompress could have made or doesn't fit in capacity.
+static long lzDecompress(const unsigned char *in, long size, unsigned char *out, long capacity)
+{
+	long position = 0;
+	long used = 0;
+
+	while(position < size)
+	{
+		int token = in[position++];
+		long n = getLength(in, size, &position, token >> 4);
+		long offset;
+
+		if(n < 0 || n > size - position || n > capacity - used)
+			return -1;
+		else;
+		memcpy(out + used, in + position, n);
+		position += n;
+		used += n;
+		if(position == size) // the last sequence
+			break;
+		else if(size - position < 2)
+			return -1;
+		else;
+		offset = in[position] | in[position + 1] << 8;
+		position += 2;
+		n = getLength(in, size, &position, token & 15);
+		if(n < 0 || offset == 0 || offset > used || n + COMPRESS_MIN_MATCH > capacity - used)
+			return -1;
+		else;
+		n += COMPRESS_MIN_MATCH;
+		//a match can overlap the bytes it makes, repeating them. What has
+		//been copied so far repeats too, so each copy can be twice as long.
+		offset = used - offset;
+		while(n > 0)
+		{
+			long chunk = used - offset < n ? used - offset : n;
+			memcpy(out + used, out + offset, chunk);
+			used += chunk;
+			n -= chunk;
+		}
+	}
+	return used;
+}
+
+// Replaces extents first up to end of a file with the n extents in with,
+// which hold the same file blocks
+static int replaceExtents(cs1550_extent_map *map, long first, long end, const cs1550_extent *with, long n)
+{
+	long nExtents = map->nExtents - (end - first) + n;
+	long k;
+
+	if(growExtents(map, nExtents) < 0)
+		return -ENOMEM;
+	else;
+	memmove(map->extents + first + n, map->extents + end, (map->nExtents - end) * sizeof(cs1550_extent));
+	memmove(map->fileBlocks + first + n, map->fileBlocks + end, (map->nExtents - end) * sizeof(long));
+	memcpy(map->extents + first, with, n * sizeof(cs1550_extent));
+	for(k = first; k < first + n; k++)
+		map->fileBlocks[k] = k > 0 ? map->fileBlocks[k - 1] + fileBlocksOf(&map->extents[k - 1]) : 0;
+	map->nExtents = nExtents;
+	if(map->dirtyFrom > first)
+		map->dirtyFrom = first;
+	else;
+	return 0;
+}
+
+// Makes an extent of a file start at file block fileBlock, splitting the
+// plain extent or hole it is in. A compressed unit can't be split, so one
+// that fileBlock falls inside has to be unpacked first; -EINVAL if it wasn't.
+static int splitExtent(cs1550_extent_map *map, long fileBlock)
+{
+	cs1550_extent halves[2];
+	long k;
+
+	if(fileBlock >= map->nBlocks)
+		return 0;
+	else;
+	k = findExtent(map, fileBlock);
+	if(map->fileBlocks[k] == fileBlock)
+		return 0;
+	else if(map->extents[k].nBlocks < 0)
+		return -EINVAL;
+	else;
+	halves[0].nStartBlock = map->extents[k].nStartBlock;
+	halves[0].nBlocks = fileBlock - map->fileBlocks[k];
+	halves[1].nStartBlock = isHole(&halves[0]) ? 0 : halves[0].nStartBlock + halves[0].nBlocks;
+	halves[1].nBlocks = map->extents[k].nBlocks - halves[0].nBlocks;
+	return replaceExtents(map, k, k + 1, halves, 2);
+}
+
+// Stops a file using count blocks at start. Their cached copies are dropped
+// so they never reach .disk, but they stay in use until flushHandle has
+// written back the blocks that replaced them. Blocks another file shares
+// keep their cached copies.
+static void releaseBlocks(cs1550_file_handle *handle, long start, long count)
+{
+	cs1550_extent *released;
+	long run = start;
+	long block;
+
+	if(fs.dedup.active)
+	{
+		pthread_mutex_lock(&fs.dedup.lock);
+		for(block = start; block < start + count; block++)
+		{
+			if(blockReferences(block) > 0)
+			{
+				if(block > run)
+					invalidateBlocks(run, block - run);
+				else;
+				run = block + 1;
+			}
+			else
+				unindexBlock(block);
+		}
+		if(block > run)
+			invalidateBlocks(run, block - run);
+		else;
+		pthread_mutex_unlock(&fs.dedup.lock);
+	}
+	else
+		invalidateBlocks(start, count);
+	pthread_mutex_lock(&handle->lock);
+	//a run that carries on from the last one released just makes it longer
+	if(handle->nReleased > 0 && handle->released[handle->nReleased - 1].nStartBlock
+		+ handle->released[handle->nReleased - 1].nBlocks == start)
+	{
+		handle->released[handle->nReleased - 1].nBlocks += count;
+		pthread_mutex_unlock(&handle->lock);
+		return;
+	}
+	else;
+	if(handle->nReleased == handle->releasedCapacity)
+	{
+		long capacity = handle->releasedCapacity > 0 ? handle->releasedCapacity * 2 : 16;
+		released = realloc(handle->released, capacity * sizeof(cs1550_extent));
+		if(released != NULL)
+		{
+			handle->released = released;
+			handle->releasedCapacity = capacity;
+		}
+		else;
+	}
+	else
+		released = handle->released;
+	if(released != NULL)
+	{
+		handle->released[handle->nReleased].nStartBlock = start;
+		handle->released[handle->nReleased].nBlocks = count;
+		handle->nReleased++;
+	}
+	else;
+	pthread_mutex_unlock(&handle->lock);
+	if(released == NULL) // with no memory to remember them they go back now
+		freeBlocks(start, count);
+	else;
+}
+
+// Notes that file blocks first up to end may have changed through a handle,
+// so its next flush writes them back
+static void markWritten(cs1550_file_handle *handle, long first, long end)
+{
+	pthread_mutex_lock(&handle->lock);
+	if(handle->writtenFrom >= handle->writtenTo)
+	{
+		handle->writtenFrom = first;
+		handle->writtenTo = end;
+	}
+	else
+	{
+		if(first < handle->writtenFrom)
+			handle->writtenFrom = first;
+		else;
+		if(end > handle->writtenTo)
+			handle->writtenTo = end;
+		else;
+	}
+	pthread_mutex_unlock(&handle->lock);
+}
+
+// Drops the blocks of a file from file block keep on, releasing them to the
+// handle along with the extent blocks the shorter list doesn't need. The
+// first extent block stays, since the directory record points at it. A
+// compressed unit that keep falls inside has to be unpacked first.
+static int cutExtents(cs1550_extent_map *map, long keep, cs1550_file_handle *handle)
+{
+	long needed;
+	long first;
+	long k;
+	int res;
+
+	if(keep >= map->nBlocks)
+		return 0;
+	else if((res = splitExtent(map, keep)) < 0)
+		return res;
+	else;
+	first = findExtent(map, keep);
+	for(k = first; k < map->nExtents; k++)
+	{
+		if(!isHole(&map->extents[k]))
+			releaseBlocks(handle, map->extents[k].nStartBlock, diskBlocksOf(&map->extents[k]));
+		else;
+	}
+	map->nExtents = first;
+	map->nBlocks = keep;
+
+	needed = (first + fs.extentsPerBlock - 1) / fs.extentsPerBlock;
+	if(needed < 1)
+		needed = 1;
+	else;
+	for(k = needed; k < map->nExtentBlocks; k++)
+		releaseBlocks(handle, map->extentBlocks[k], 1);
+	if(map->nExtentBlocks > needed)
+		map->nExtentBlocks = needed;
+	else;
+	//the new last extent block loses its link even if none of its extents went
+	if(map->dirtyFrom > (needed - 1) * fs.extentsPerBlock)
+		map->dirtyFrom = (needed - 1) * fs.extentsPerBlock;
+	else;
+	if(map->compressFrom > keep)
+		map->compressFrom = keep;
+	else;
+	if(map->dedupFrom > keep)
+		map->dedupFrom = keep;
+	else;
+	return 0;
+}
+
+// Reads the compressed extent and decompresses it into unit, which has room
+// for fs.compressBlocks blocks
+static int readPacked(const cs1550_extent *extent, char *unit)
+{
+	long bytes = diskBlocksOf(extent) * fs.blockSize;
+	long unitBytes = fs.compressBlocks * fs.blockSize;
+	cs1550_packed_unit *packed = arenaPush(bytes);
+	int res = 0;
+
+	if(packed == NULL)
+		return -ENOMEM;
+	else;
+	if(readRun(extent->nStartBlock, 0, (char *)packed, bytes) != bytes
+		|| packed->size > bytes - sizeof(cs1550_packed_unit)
+		|| lzDecompress(packed->data, packed->size, (unsigned char *)unit, unitBytes) != unitBytes)
+		res = -EIO;
+	else;
+	arenaPop(bytes);
+	return res;
+}
+
+// Copies size bytes of a file starting at offset into buf, one extent at a
+// time. Everything the request needs from a plain extent is one readRun,
+// since its blocks are next to each other on disk, a compressed extent is
+// decompressed whole and a hole is zeros without reading anything. Returns
+// how much was copied, which is less than size if the extents end early.
+static long readExtents(cs1550_extent_map *map, char *buf, long size, long offset)
+{
+	long sizeRead = 0;
+
+	while(sizeRead < size)
+	{
+		long position = offset + sizeRead;
+		long fileBlock = position / fs.blockSize;
+		long k;
+		long inExtent;
+		long toRead;
+		ssize_t bytes;
+		
+		if(fileBlock >= map->nBlocks) // size says there is data here but the extents end early
+			break;
+		else;
+		k = findExtent(map, fileBlock);
+		inExtent = position - map->fileBlocks[k] * fs.blockSize;
+		toRead = fileBlocksOf(&map->extents[k]) * fs.blockSize - inExtent;
+		if(toRead > size - sizeRead)
+			toRead = size - sizeRead;
+		else;
+		
+		#if DEBUGFILEREAD
+		printf("Reading %ld bytes from extent %ld at block %ld\n", toRead, k, map->extents[k].nStartBlock);
+		#endif
+		if(isHole(&map->extents[k]))
+		{
+			memset(buf + sizeRead, 0, toRead);
+			bytes = toRead;
+		}
+		else if(map->extents[k].nBlocks < 0)
+		{
+			long unitBytes = fs.compressBlocks * fs.blockSize;
+			char *unit = arenaPush(unitBytes);
+			bytes = unit == NULL || readPacked(&map->extents[k], unit) < 0 ? -1 : toRead;
+			if(bytes > 0)
+				memcpy(buf + sizeRead, unit + inExtent, toRead);
+			else;
+			if(unit != NULL)
+				arenaPop(unitBytes);
+			else;
+		}
+		else
+			bytes = readRun(map->extents[k].nStartBlock, inExtent, buf + sizeRead, toRead);
+		//a read that fails part way returns what it got, and the next read
+		//from there the error
+		if(bytes < 0 && sizeRead == 0)
+			return -EIO;
+		else if(bytes <= 0)
+			break;
+		else;
+		sizeRead += bytes;
+	}
+	return sizeRead;
+}
+
+// Writes a unit packUnit compressed to size bytes to blocks of its own and
+// puts them in the file's extents in place of the plain blocks it was in,
+// which are released to the handle. The unit stays plain if there's no room.
+static int storePacked(cs1550_extent_map *map, long first, cs1550_packed_unit *packed, long size, cs1550_file_handle *handle)
+{
+	long stored = (sizeof(cs1550_packed_unit) + size + fs.blockSize - 1) / fs.blockSize;
+	cs1550_extent extent;
+	long count = poolAllocate(stored, &extent.nStartBlock);
+	long end;
+	long k;
+	int res;
+
+	if(count < stored)
+	{
+		if(count > 0)
+			freeBlocks(extent.nStartBlock, count);
+		else;
+		return 0;
+	}
+	else;
+	packed->size = size;
+	memset(packed->data + size, 0, stored * fs.blockSize - sizeof(cs1550_packed_unit) - size);
+	if(writeRun(extent.nStartBlock, 0, (char *)packed, stored * fs.blockSize, 0) != stored * fs.blockSize)
+	{
+		freeBlocks(extent.nStartBlock, stored);
+		return -EIO;
+	}
+	else if((res = splitExtent(map, first)) < 0 || (res = splitExtent(map, first + fs.compressBlocks)) < 0)
+	{
+		freeBlocks(extent.nStartBlock, stored);
+		return res;
+	}
+	else;
+
+	k = findExtent(map, first);
+	end = first + fs.compressBlocks < map->nBlocks ? findExtent(map, first + fs.compressBlocks) : map->nExtents;
+	for(count = k; count < end; count++)
+		releaseBlocks(handle, map->extents[count].nStartBlock, map->extents[count].nBlocks);
+	//fewer extents than before, so this can't run out of memory
+	extent.nBlocks = -stored;
+	replaceExtents(map, k, end, &extent, 1);
+	__sync_fetch_and_add(&fs.stats.packedUnits, 1);
+	__sync_fetch_and_add(&fs.stats.packedBlocks, fs.compressBlocks);
+	__sync_fetch_and_add(&fs.stats.storedBlocks, stored);
+	return 0;
+}
+
+// Says whether any of count file blocks from first is in a hole
+static int blocksMissing(cs1550_extent_map *map, long first, long count)
+{
+	long fileBlock = first;
+
+	while(fileBlock < first + count && fileBlock < map->nBlocks)
+	{
+		long k = findExtent(map, fileBlock);
+		if(isHole(&map->extents[k]))
+			return 1;
+		else;
+		fileBlock = map->fileBlocks[k] + fileBlocksOf(&map->extents[k]);
+	}
+	return fileBlock < first + count;
+}
+
+// Says whether any of count plain file blocks from first is shared with
+// another file or another part of this one
+static int blocksShared(cs1550_extent_map *map, long first, long count)
+{
+	long fileBlock;
+	int shared = 0;
+
+	if(!fs.dedup.active)
+		return 0;
+	else;
+	pthread_mutex_lock(&fs.dedup.lock);
+	for(fileBlock = first; fileBlock < first + count && !shared; fileBlock++)
+	{
+		long k = findExtent(map, fileBlock);
+		shared = blockReferences(map->extents[k].nStartBlock + fileBlock - map->fileBlocks[k]) > 0;
+	}
+	pthread_mutex_unlock(&fs.dedup.lock);
+	return shared;
+}
+
+// Compresses unit u of a file, its fs.compressBlocks file blocks from
+// u * fs.compressBlocks, if that saves at least one block. Units with shared
+// blocks are left plain, since packing them would give up the sharing, and
+// so are units with holes, which cost nothing as they are. The caller saves
+// the extent map.
+static int packUnit(cs1550_extent_map *map, long u, cs1550_file_handle *handle)
+{
+	long first = u * fs.compressBlocks;
+	long bytes = fs.compressBlocks * fs.blockSize;
+	long room = bytes - fs.blockSize;
+	cs1550_packed_unit *packed;
+	char *data;
+	long size;
+	int res = 0;
+
+	if(map->extents[findExtent(map, first)].nBlocks < 0 // compressed already
+		|| blocksMissing(map, first, fs.compressBlocks) || blocksShared(map, first, fs.compressBlocks))
+		return 0;
+	else;
+	data = arenaPush(bytes + room);
+	if(data == NULL)
+		return -ENOMEM;
+	else;
+	packed = (cs1550_packed_unit *)(data + bytes);
+	if(readExtents(map, data, bytes, first * fs.blockSize) != bytes)
+		res = -EIO;
+	else if((size = lzCompress((unsigned char *)data, bytes, packed->data, room - sizeof(cs1550_packed_unit))) < 0)
+		__sync_fetch_and_add(&fs.stats.incompressible, 1);
+	else
+		res = storePacked(map, first, packed, size, handle);
+	arenaPop(bytes + room);
+	return res;
+}
+
+// Turns compressed extent k of a file back into plain blocks so it can be
+// written to, and releases the compressed blocks to the handle
+static int unpackUnit(cs1550_extent_map *map, long k, cs1550_file_handle *handle)
+{
+	cs1550_extent packed = map->extents[k];
+	cs1550_extent runs[COMPRESS_BYTES / BLOCK_SIZE];
+	long bytes = fs.compressBlocks * fs.blockSize;
+	char *unit = arenaPush(bytes);
+	long done = 0;
+	long n = 0;
+	long i;
+	int res;
+
+	if(unit == NULL)
+		return -ENOMEM;
+	else;
+	res = readPacked(&packed, unit);
+	while(res == 0 && done < fs.compressBlocks)
+	{
+		long count = poolAllocate(fs.compressBlocks - done, &runs[n].nStartBlock);
+		if(count < 1)
+			res = -ENOSPC;
+		else
+		{
+			runs[n++].nBlocks = count;
+			if(writeRun(runs[n - 1].nStartBlock, 0, unit + done * fs.blockSize, count * fs.blockSize, 0) != count * fs.blockSize)
+				res = -EIO;
+			else;
+			done += count;
+		}
+	}
+	arenaPop(bytes);
+	if(res == 0)
+		res = replaceExtents(map, k, k + 1, runs, n);
+	else;
+	if(res < 0)
+	{
+		for(i = 0; i < n; i++)
+			freeBlocks(runs[i].nStartBlock, runs[i].nBlocks);
+		return res;
+	}
+	else;
+	releaseBlocks(handle, packed.nStartBlock, -packed.nBlocks);
+	markWritten(handle, map->fileBlocks[k], map->fileBlocks[k] + fs.compressBlocks);
+	__sync_fetch_and_add(&fs.stats.unpackedUnits, 1);
+	return 0;
+}
+
+// Says whether a file is kept plain because of its extension or because its
+// directory has a file called NOCOMPRESS_NAME
+static int keepPlain(int slot, int i)
+{
+	const char *extension = fs.directories.entries[slot].files[i].fext;
+	int index;
+	int e;
+
+	for(e = 0; compressedExtensions[e] != NULL; e++)
+	{
+		if(strcasecmp(extension, compressedExtensions[e]) == 0)
+			return 1;
+		else;
+	}
+	return findFile(fs.directories.heads[slot], NOCOMPRESS_NAME, "", &index) >= 0;
+}
+
+// Compresses every whole unit of a file that was written since it was last
+// compressed. size is the file's size; the caller saves the extent map.
+static int packFile(cs1550_extent_map *map, long size, cs1550_file_handle *handle)
+{
+	long units = (size / fs.blockSize < map->nBlocks ? size / fs.blockSize : map->nBlocks) / fs.compressBlocks;
+	long u;
+	int res = 0;
+
+	//with blocks as big as a unit nothing can be saved
+	if(fs.compressBlocks < 2)
+		return 0;
+	else;
+	for(u = map->compressFrom / fs.compressBlocks; u < units && res == 0; u++)
+		res = packUnit(map, u, handle);
+	if(res == 0 && map->compressFrom < units * fs.compressBlocks)
+		map->compressFrom = units * fs.compressBlocks;
+	else;
+	return res;
+}
+
+// 64-bit multiply and xor hash of one block of data, for the dedup index
+static uint64_t blockHash(const char *data)
+{
+	const uint64_t *words = (const uint64_t *)data;
+	uint64_t hash = 0;
+	long i;
+
+	for(i = 0; i < fs.blockSize / 8; i++)
+		hash = (hash ^ words[i]) * 0x9e3779b97f4a7c15ULL;
+	//the slot comes from the low bits, which the multiplies leave weakest
+	hash ^= hash >> 32;
+	return hash * 0xff51afd7ed558ccdULL ^ (hash >> 29);
+}
+
+// Returns the slot of the dedup index holding hash, or the empty slot where
+// it would go. The caller holds the dedup lock.
+static long indexSlot(uint64_t hash)
+{
+	long mask = fs.dedup.indexSlots - 1;
+	long s = hash & mask;
+
+	while(fs.dedup.index[s].block != 0 && fs.dedup.index[s].hash != hash)
+		s = (s + 1) & mask;
+	return s;
+}
+
+// Says whether a block's index entry still matches its data. The caller
+// holds the dedup lock.
+static int blockIndexed(long block)
+{
+	return (fs.dedup.indexed[block / 8] >> (block % 8)) & 1;
+}
+
+// Records in the dedup index that a block holds data with the given hash. A
+// full index is built again, without the entries of blocks that changed
+// since, at twice as many slots as the entries left. The caller holds the
+// dedup lock.
+static int indexBlock(uint64_t hash, long block)
+{
+	cs1550_dedup *dedup = &fs.dedup;
+	long s;
+
+	if((dedup->nIndexed + 1) * 4 > dedup->indexSlots * 3)
+	{
+		cs1550_dedup_entry *old = dedup->index;
+		cs1550_dedup_entry *index;
+		long oldSlots = dedup->indexSlots;
+		long slots = DEDUP_MIN_SLOTS;
+		long live = 1;
+
+		for(s = 0; s < oldSlots; s++)
+			live += old[s].block != 0 && blockIndexed(old[s].block);
+		while(slots < live * 2)
+			slots *= 2;
+		index = calloc(slots, sizeof(cs1550_dedup_entry));
+		if(index == NULL)
+			return -ENOMEM;
+		else;
+		dedup->index = index;
+		dedup->indexSlots = slots;
+		dedup->nIndexed = 0;
+		for(s = 0; s < oldSlots; s++)
+		{
+			if(old[s].block != 0 && blockIndexed(old[s].block))
+			{
+				index[indexSlot(old[s].hash)] = old[s];
+				dedup->nIndexed++;
+			}
+			else;
+		}
+		free(old);
+	}
+	else;
+	s = indexSlot(hash);
+	if(dedup->index[s].block == 0)
+		dedup->nIndexed++;
+	else;
+	dedup->index[s].hash = hash;
+	dedup->index[s].block = block;
+	dedup->indexed[block / 8] |= 1 << (block % 8);
+	return 0;
+}
+
+// Looks in the dedup index for a block other than block, which holds data,
+// with the same data, and counts one more user for it if there is one.
+// Returns that block, or 0 if there is none and block was indexed instead.
+// The other block is read into scratch and compared under the dedup lock,
+// so no write can change it in between.
+static long findDuplicate(const char *data, long block, char *scratch)
+{
+	cs1550_dedup *dedup = &fs.dedup;
+	uint64_t hash = blockHash(data);
+	long duplicate;
+	long res;
+
+	pthread_mutex_lock(&dedup->lock);
+	dedup->hashed++;
+	duplicate = dedup->index[indexSlot(hash)].block;
+	if(duplicate != 0 && duplicate != block && blockIndexed(duplicate)
+		&& readRun(duplicate, 0, scratch, fs.blockSize) == fs.blockSize
+		&& memcmp(data, scratch, fs.blockSize) == 0)
+	{
+		res = addReference(duplicate);
+		if(res == 0)
+		{
+			dedup->deduplicated++;
+			res = duplicate;
+			//from now on every mount has to count the references again
+			pthread_mutex_lock(&fs.allocatorLock);
+			fs.management.sharedBlocks = 1;
+			pthread_mutex_unlock(&fs.allocatorLock);
+		}
+		else;
+	}
+	else
+		res = indexBlock(hash, block);
+	pthread_mutex_unlock(&dedup->lock);
+	return res;
+}
+
+// Points file block fileBlock of a file at block, which holds the same data,
+// and releases the plain block it was in to the handle. The extent before it
+// takes it in if block follows on from it on disk.
+static int repointBlock(cs1550_extent_map *map, long fileBlock, long block, cs1550_file_handle *handle)
+{
+	cs1550_extent extent;
+	long k;
+	int res;
+
+	if((res = splitExtent(map, fileBlock)) < 0 || (res = splitExtent(map, fileBlock + 1)) < 0)
+		return res;
+	else;
+	k = findExtent(map, fileBlock);
+	releaseBlocks(handle, map->extents[k].nStartBlock, 1);
+	extent.nStartBlock = block;
+	extent.nBlocks = 1;
+	//no more extents than before, so neither can run out of memory
+	if(k > 0 && !isHole(&map->extents[k - 1]) && map->extents[k - 1].nBlocks > 0
+		&& map->extents[k - 1].nStartBlock + map->extents[k - 1].nBlocks == block)
+	{
+		extent.nStartBlock = map->extents[k - 1].nStartBlock;
+		extent.nBlocks = map->extents[k - 1].nBlocks + 1;
+		return replaceExtents(map, k - 1, k + 1, &extent, 1);
+	}
+	else;
+	return replaceExtents(map, k, k + 1, &extent, 1);
+}
+
+// Shares each whole plain block of a file written since it was last
+// deduplicated with a block holding the same data if the index knows one,
+// and indexes the rest. size is the file's size; the caller saves the
+// extent map.
+static int dedupFile(cs1550_extent_map *map, long size, cs1550_file_handle *handle)
+{
+	long end = size / fs.blockSize < map->nBlocks ? size / fs.blockSize : map->nBlocks;
+	char *data = arenaPush(2 * fs.blockSize);
+	long fileBlock;
+	int res = 0;
+
+	if(data == NULL)
+		return -ENOMEM;
+	else;
+	for(fileBlock = map->dedupFrom; fileBlock < end && res == 0; fileBlock++)
+	{
+		long k = findExtent(map, fileBlock);
+		long block = map->extents[k].nStartBlock + fileBlock - map->fileBlocks[k];
+		long duplicate;
+
+		if(map->extents[k].nBlocks < 0) // compressed units are left as they are
+			fileBlock = map->fileBlocks[k] + fs.compressBlocks - 1;
+		else if(isHole(&map->extents[k]))
+			fileBlock = map->fileBlocks[k] + map->extents[k].nBlocks - 1;
+		else if(readRun(block, 0, data, fs.blockSize) != fs.blockSize)
+			res = -EIO;
+		else if((duplicate = findDuplicate(data, block, data + fs.blockSize)) < 0)
+			res = duplicate;
+		else if(duplicate > 0 && (res = repointBlock(map, fileBlock, duplicate, handle)) < 0)
+		{
+			pthread_mutex_lock(&fs.dedup.lock);
+			dropReference(duplicate);
+			pthread_mutex_unlock(&fs.dedup.lock);
+		}
+		else;
+	}
+	if(res == 0 && map->dedupFrom < end)
+		map->dedupFrom = end;
+	else;
+	arenaPop(2 * fs.blockSize);
+	return res;
+}
+
+// Gives file block fileBlock of a file a block of its own in place of the
+// shared one it is in, which is released to the handle. The data is copied
+// over unless whole says a write is about to replace all of it.
+static int copyBlock(cs1550_extent_map *map, long fileBlock, cs1550_file_handle *handle, int whole)
+{
+	cs1550_extent extent;
+	char *data;
+	long k;
+	int res = 0;
+
+	if((res = splitExtent(map, fileBlock)) < 0 || (res = splitExtent(map, fileBlock + 1)) < 0)
+		return res;
+	else if(poolAllocate(1, &extent.nStartBlock) < 1)
+		return -ENOSPC;
+	else;
+	extent.nBlocks = 1;
+	k = findExtent(map, fileBlock);
+	if(!whole)
+	{
+		data = arenaPush(fs.blockSize);
+		if(data == NULL)
+			res = -ENOMEM;
+		else if(readRun(map->extents[k].nStartBlock, 0, data, fs.blockSize) != fs.blockSize
+			|| writeRun(extent.nStartBlock, 0, data, fs.blockSize, 0) != fs.blockSize)
+			res = -EIO;
+		else;
+		if(data != NULL)
+			arenaPop(fs.blockSize);
+		else;
+	}
+	else;
+	if(res < 0)
+	{
+		freeBlocks(extent.nStartBlock, 1);
+		return res;
+	}
+	else;
+	releaseBlocks(handle, map->extents[k].nStartBlock, 1);
+	replaceExtents(map, k, k + 1, &extent, 1);
+	pthread_mutex_lock(&fs.dedup.lock);
+	fs.dedup.copies++;
+	pthread_mutex_unlock(&fs.dedup.lock);
+	return 0;
+}
+
+// Gets the plain blocks a write of size bytes at offset is about to change
+// ready for it. Their index entries stop matching, and shared ones are
+// copied first so the other extents using them keep their data. Compressed
+// units are passed over: dedup only shares and indexes plain blocks, and
+// the write unpacks the units it covers itself.
+static int unshareBlocks(cs1550_extent_map *map, cs1550_file_handle *handle, off_t offset, size_t size)
+{
+	long fileBlock = offset / fs.blockSize;
+	long end = (offset + size + fs.blockSize - 1) / fs.blockSize;
+	int res = 0;
+
+	if(end > map->nBlocks)
+		end = map->nBlocks;
+	else;
+	while(fileBlock < end && res == 0)
+	{
+		long k = findExtent(map, fileBlock);
+		long last = map->fileBlocks[k] + fileBlocksOf(&map->extents[k]) < end ? map->fileBlocks[k] + fileBlocksOf(&map->extents[k]) : end;
+		int shared = 0;
+
+		if(isHole(&map->extents[k]) || map->extents[k].nBlocks < 0)
+		{
+			fileBlock = last;
+			continue;
+		}
+		else;
+		//one lock for the part of the write in each extent, up to a shared block
+		pthread_mutex_lock(&fs.dedup.lock);
+		for(; fileBlock < last && !shared; fileBlock++)
+		{
+			long block = map->extents[k].nStartBlock + fileBlock - map->fileBlocks[k];
+			if(blockReferences(block) > 0)
+				shared = 1;
+			else
+				unindexBlock(block);
+		}
+		pthread_mutex_unlock(&fs.dedup.lock);
+		if(shared)
+			res = copyBlock(map, fileBlock - 1, handle, offset <= (fileBlock - 1) * fs.blockSize
+				&& offset + (long)size >= fileBlock * fs.blockSize);
+		else;
+	}
+	return res;
+}
+
+// Deduplicates what was written through the handle for -o dedup and
+// compresses it for -o compress, unless keepPlain says the file opts out of
+// compression, then saves the file's extent map. Dedup goes first so that
+// the blocks it shares stay plain.
+static int packHandle(cs1550_file_handle *handle)
+{
+	cs1550_extent_map *map;
+	long size;
+	int slot;
+	int i;
+	int res = 0;
+
+	if(lockHandle(handle, &slot, &i) < 0) // removed while it was open
+		return 0;
+	else;
+	pthread_rwlock_wrlock(fileLock(slot, i));
+	map = &fs.directories.maps[slot * MAX_FILES_IN_DIR + i];
+	size = fs.directories.entries[slot].files[i].fsize;
+	if(map->loaded && map->inlineData == NULL)
+	{
+		if(options.dedup && map->dedupFrom < map->nBlocks)
+			res = dedupFile(map, size, handle);
+		else;
+		if(res == 0 && options.compress && map->compressFrom < map->nBlocks && !keepPlain(slot, i))
+		{
+			markWritten(handle, map->compressFrom / fs.compressBlocks * fs.compressBlocks, map->nBlocks);
+			res = packFile(map, size, handle);
+		}
+		else;
+		if(map->dirtyFrom != MAP_SAVED && saveExtentMap(map) < 0)
+			res = -EIO;
+		else;
+	}
+	else;
+	pthread_rwlock_unlock(fileLock(slot, i));
+	unlockDirectory(slot);
+	return res;
+}
+
+// Sums the blocks written through the mapping since they were last summed.
+// Each bit is cleared before its block is read, so a write that is still
+// copying when this runs sets it again and the block is summed next time.
+static void sumChanged()
+{
+	cs1550_checksums *checksums = &fs.checksums;
+	long i;
+	long block;
+
+	if(checksums->sums == NULL || fs.diskMap == NULL)
+		return;
+	else;
+	for(i = 0; i < (fs.nBlocks + 7) / 8; i++)
+	{
+		if(__sync_fetch_and_or(&checksums->changed[i], 0) == 0)
+			continue;
+		else;
+		for(block = i * 8; block < i * 8 + 8 && block < fs.nBlocks; block++)
+		{
+			if(blockBit(checksums->changed, block))
+			{
+				beginWrite();
+				setBlockBit(checksums->changed, block, 0);
+				sumBlocks(block, fs.diskMap + (off_t)block * fs.blockSize, 1);
+				setBlockBit(checksums->verified, block, 1);
+				endWrite();
+			}
+			else;
+		}
+	}
+}
+
+// Writes the blocks of the checksum table that changed. A block is marked
+// clean before it is copied, so a checksum stored meanwhile marks it again.
+// The caller holds the allocator lock.
+static int saveChecksums()
+{
+	cs1550_checksums *checksums = &fs.checksums;
+	uint32_t *copy;
+	long perBlock = fs.blockSize / sizeof(uint32_t);
+	long i;
+	long k;
+	int res = 0;
+
+	if(checksums->sums == NULL || fs.management.checksumBlocks <= 0)
+		return 0;
+	else;
+	sumChanged();
+	copy = arenaPush(fs.blockSize);
+	if(copy == NULL)
+		return -ENOMEM;
+	else;
+	for(i = 0; i < fs.management.checksumBlocks && res == 0; i++)
+	{
+		if(!__sync_lock_test_and_set(&checksums->dirty[i], 0))
+			continue;
+		else;
+		for(k = 0; k < perBlock; k++)
+			copy[k] = loadSum(i * perBlock + k);
+		if(writeDisk((off_t)(fs.management.checksumStart + i) * fs.blockSize, copy, fs.blockSize) < 0)
+		{
+			__sync_lock_test_and_set(&checksums->dirty[i], 1);
+			res = -EIO;
+		}
+		else;
+	}
+	arenaPop(fs.blockSize);
+	return res;
+}
+
+// Writes the parts of the bitmap that changed and the disk management block.
+// Allocation only changes memory, so this is what makes it stick; it runs
+// when a file is synced and at unmount. clean says whether the mount is
+// ending, which clears the flag that makes the next mount rebuild the bitmap.
+static int saveAllocator(int clean)
+{
+	cs1550_allocator *allocator = &fs.allocator;
+	long i;
+	int res = 0;
+
+	pthread_mutex_lock(&fs.allocatorLock);
+	for(i = 0; i < fs.bitmapBlocks && res == 0; i++)
+	{
+		if(allocator->dirty[i])
+		{
+			if(writeBlock(fs.management.bitmapStart + i, allocator->bitmap + i * fs.blockSize) < 0)
+				res = -EIO;
+			else
+				allocator->dirty[i] = 0;
+		}
+		else;
+	}
+	if(res == 0)
+		res = saveChecksums();
+	else;
+	fs.management.free = allocator->cursor;
+	fs.management.dirty = clean ? 0 : 1;
+	if(res == 0 && writeDisk(0, &fs.management, sizeof(cs1550_disk_management)) < 0)
+		res = -EIO;
+	else;
+	pthread_mutex_unlock(&fs.allocatorLock);
+	return res;
+}
+
+// Marks the blocks of an extent as used while the bitmap is rebuilt. A plain
+// block another extent already uses is shared, and counted in the shared
+// block table instead. Nothing else runs yet, so the dedup lock isn't taken.
+static int markExtent(const cs1550_extent *extent)
+{
+	long block;
+
+	if(isHole(extent))
+		return 0;
+	else if(extent->nBlocks < 0)
+	{
+		markBlocks(extent->nStartBlock, -extent->nBlocks, 1);
+		return 0;
+	}
+	else;
+	for(block = extent->nStartBlock; block < extent->nStartBlock + extent->nBlocks; block++)
+	{
+		if(!blockInUse(block))
+			markBlocks(block, 1, 1);
+		else if(addReference(block) < 0)
+			return -ENOMEM;
+		else;
+	}
+	return 0;
+}
+
+// Works out which blocks are in use from the extent lists of every file, and
+// how many extents use each shared block. Used when the image has no bitmap
+// yet, wasn't unmounted cleanly or has shared blocks.
+static int rebuildAllocator()
+{
+	cs1550_directory_cache *cache = &fs.directories;
+	int slot;
+	int i;
+	long k;
+
+	#if DEBUGALLOCATE
+	printf("Rebuilding the free space bitmap\n");
+	#endif
+	if(resetAllocator() < 0)
+		return -ENOMEM;
+	else;
+	if(fs.management.bitmapStart > 0)
+		markBlocks(fs.management.bitmapStart, fs.bitmapBlocks, 1);
+	else;
+	if(fs.management.journalStart > 0)
+		markBlocks(fs.management.journalStart, fs.management.journalBlocks, 1);
+	else;
+	if(fs.management.checksumStart > 0)
+		markBlocks(fs.management.checksumStart, fs.management.checksumBlocks, 1);
+	else;
+
+	for(slot = 0; slot < cache->nRecords; slot++)
+	{
+		for(i = 0; i < cache->entries[slot].nFiles; i++)
+		{
+			cs1550_extent_map *map;
+			if(isDirectoryFile(&cache->entries[slot].files[i]))
+				continue;
+			else;
+			map = getExtentMap(slot, i);
+			if(map == NULL)
+				return -EIO;
+			else;
+			for(k = 0; k < map->nExtentBlocks; k++)
+				markBlocks(map->extentBlocks[k], 1, 1);
+			for(k = 0; k < map->nExtents; k++)
+			{
+				if(markExtent(&map->extents[k]) < 0)
+					return -ENOMEM;
+				else;
+			}
+		}
+	}
+	fs.management.sharedBlocks = fs.dedup.nShared > 0;
+
+	//images without a bitmap get one wherever there is room
+	if(fs.management.bitmapStart <= 0)
+	{
+		long start;
+		if(allocateBlocks(fs.bitmapBlocks, &start) != fs.bitmapBlocks)
+			return -ENOSPC;
+		else;
+		fs.management.bitmapStart = start;
+	}
+	else;
+	memset(fs.allocator.dirty, 1, fs.bitmapBlocks);
+	return 0;
+}
+
+// Gives the disk a journal region if there is room for one. Without one
+// directory records keep being written in place.
+static void allocateJournal()
+{
+	long blocks = JOURNAL_BYTES / fs.blockSize;
+	long start;
+	long count;
+
+	if(blocks > fs.nBlocks / 16)
+		blocks = fs.nBlocks / 16;
+	else;
+	if(blocks * fs.blockSize < transactionBytes(JOURNAL_RECORDS))
+		return;
+	else;
+	count = allocateBlocks(blocks, &start);
+	if(count < blocks)
+	{
+		if(count > 0)
+			markBlocks(start, count, 0);
+		else;
+		return;
+	}
+	else;
+	fs.management.journalStart = start;
+	fs.management.journalBlocks = blocks;
+	fs.management.journalSequence = 1;
+}
+
+// Sets up the checksum table in memory at mount, before anything is read
+// through readBlock, and reads it from .disk if the last mount ended
+// cleanly. Returns 1 if the table has to be worked out again from the
+// blocks themselves, because there was none or it may be out of date.
+static int loadChecksums()
+{
+	cs1550_checksums *checksums = &fs.checksums;
+	long tableBlocks = (fs.nBlocks * (long)sizeof(uint32_t) + fs.blockSize - 1) / fs.blockSize;
+	long i;
+
+	if(!options.checksums)
+		return 0;
+	else;
+	checksums->sums = calloc(tableBlocks, fs.blockSize);
+	checksums->dirty = calloc(tableBlocks, 1);
+	checksums->changed = calloc((fs.nBlocks + 7) / 8, 1);
+	checksums->verified = calloc((fs.nBlocks + 7) / 8, 1);
+	if(checksums->sums == NULL || checksums->dirty == NULL || checksums->changed == NULL || checksums->verified == NULL)
+		return -ENOMEM;
+	else;
+	if(fs.management.checksumStart <= 0 || fs.management.checksumBlocks != tableBlocks || fs.management.dirty)
+		return 1;
+	else;
+	for(i = 0; i < tableBlocks; i++)
+	{
+		if(readDisk((off_t)(fs.management.checksumStart + i) * fs.blockSize,
+			(char *)checksums->sums + i * fs.blockSize, fs.blockSize) < 0)
+		{
+			memset(checksums->sums, 0, tableBlocks * fs.blockSize);
+			return 1;
+		}
+		else;
+	}
+	return 0;
+}
+
+// Frees the checksum table in memory, turning checksums off
+static void dropChecksums()
+{
+	cs1550_checksums *checksums = &fs.checksums;
+
+	free(checksums->sums);
+	free(checksums->dirty);
+	free(checksums->changed);
+	free(checksums->verified);
+	checksums->sums = NULL;
+	checksums->dirty = NULL;
+	checksums->changed = NULL;
+	checksums->verified = NULL;
+}
+
+// Sums every block in use but the journal, which has checksums of its own,
+// reading them from .disk as many at a time as the arena holds. Blocks not
+// in use lose theirs. Nothing else runs yet, so no lock is taken.
+static int sumInUse()
+{
+	long perRead = ARENA_BYTES / fs.blockSize;
+	char *buf = arenaPush(perRead * fs.blockSize);
+	long block;
+	long count;
+	long i;
+	int res = 0;
+
+	if(buf == NULL)
+		return -ENOMEM;
+	else;
+	for(block = 1; block < fs.nBlocks && res == 0; block += count)
+	{
+		int used = blockInUse(block) && (block < fs.management.journalStart
+			|| block >= fs.management.journalStart + fs.management.journalBlocks);
+		for(count = 1; count < perRead && block + count < fs.nBlocks; count++)
+		{
+			long next = block + count;
+			if(used != (blockInUse(next) && (next < fs.management.journalStart
+				|| next >= fs.management.journalStart + fs.management.journalBlocks)))
+				break;
+			else;
+		}
+		if(!used)
+		{
+			for(i = block; i < block + count; i++)
+			{
+				if(summedBlock(i))
+					storeSum(i, 0);
+				else;
+			}
+		}
+		else if(readDisk((off_t)block * fs.blockSize, buf, count * fs.blockSize) < 0)
+			res = -EIO;
+		else
+			sumBlocks(block, buf, count);
+	}
+	arenaPop(perRead * fs.blockSize);
+	return res;
+}
+
+// Gives the disk its checksum table once the allocator is set up, or takes
+// it away when checksums are turned off, and works the checksums out again
+// if stale says loadChecksums couldn't use the ones saved. With no room
+// for a table checksums are turned off for this mount.
+static int allocateChecksums(int stale)
+{
+	cs1550_checksums *checksums = &fs.checksums;
+	long tableBlocks = (fs.nBlocks * (long)sizeof(uint32_t) + fs.blockSize - 1) / fs.blockSize;
+	long start;
+	long count;
+
+	if(checksums->sums == NULL || fs.management.checksumBlocks != tableBlocks)
+	{
+		if(fs.management.checksumStart > 0)
+			markBlocks(fs.management.checksumStart, fs.management.checksumBlocks, 0);
+		else;
+		fs.management.checksumStart = 0;
+		fs.management.checksumBlocks = 0;
+	}
+	else;
+	if(checksums->sums == NULL)
+		return 0;
+	else if(fs.management.checksumStart <= 0)
+	{
+		count = allocateBlocks(tableBlocks, &start);
+		if(count < tableBlocks)
+		{
+			if(count > 0)
+				markBlocks(start, count, 0);
+			else;
+			fprintf(stderr, "cs1550: no room for block checksums, they are off\n");
+			dropChecksums();
+			return 0;
+		}
+		else;
+		fs.management.checksumStart = start;
+		fs.management.checksumBlocks = tableBlocks;
+	}
+	else;
+	if(!stale)
+		return 0;
+	else;
+	#if DEBUGALLOCATE
+	printf("Working out the checksums of every block in use\n");
+	#endif
+	memset(checksums->dirty, 1, tableBlocks);
+	return sumInUse();
+}
+
+// Sets up dedup once the allocator has counted the shared blocks. Their
+// reference counts are kept whenever there are any, with -o dedup or not;
+// the index is only needed to share more.
+static int initDedup()
+{
+	cs1550_dedup *dedup = &fs.dedup;
+
+	dedup->active = options.dedup || dedup->nShared > 0;
+	if(!options.dedup)
+		return 0;
+	else;
+	dedup->indexed = calloc((fs.nBlocks + 7) / 8, 1);
+	dedup->index = calloc(DEDUP_MIN_SLOTS, sizeof(cs1550_dedup_entry));
+	if(dedup->indexed == NULL || dedup->index == NULL)
+		return -ENOMEM;
+	else;
+	dedup->indexSlots = DEDUP_MIN_SLOTS;
+	return 0;
+}
+
+// Sets up the allocator at mount, reading the bitmap if the last mount ended
+// cleanly and rebuilding it otherwise, or if blocks are shared, since their
+// reference counts are only kept in memory. The management block is marked
+// dirty and synced before anything is allocated, so a crash while mounted
+// is always noticed by the next mount.
+static int loadAllocator()
+{
+	cs1550_allocator *allocator = &fs.allocator;
+	long i;
+	int stale;
+	int res;
+
+	stale = loadChecksums();
+	if(stale < 0)
+		return stale;
+	else;
+	if(fs.management.bitmapStart > 0 && !fs.management.dirty && !fs.management.sharedBlocks)
+	{
+		if(resetAllocator() < 0)
+			return -ENOMEM;
+		else;
+		for(i = 0; i < fs.bitmapBlocks; i++)
+		{
+			if(readBlock(fs.management.bitmapStart + i, allocator->bitmap + i * fs.blockSize) < 0)
+				return -EIO;
+			else;
+		}
+		allocator->nFree = 0;
+		for(i = 1; i < fs.nBlocks; i++)
+		{
+			if(!blockInUse(i))
+				allocator->nFree++;
+			else;
+		}
+		memset(allocator->dirty, 0, fs.bitmapBlocks);
+		if(fs.management.free > 0 && fs.management.free < fs.nBlocks)
+			allocator->cursor = fs.management.free;
+		else;
+	}
+	else
+	{
+		res = rebuildAllocator();
+		if(res < 0)
+			return res;
+		else;
+	}
+
+	res = initDedup();
+	if(res < 0)
+		return res;
+	else;
+
+	if(fs.management.journalStart <= 0)
+		allocateJournal();
+	else;
+	res = allocateChecksums(stale);
+	if(res < 0)
+		return res;
+	else;
+
+	fs.management.prevAllocations = 1;
+	res = saveAllocator(0);
+	if(res == 0 && fsync(fs.diskFd) < 0)
+		res = -EIO;
+	else;
+	return res;
+}
+
+// Copies one backing file to another, used to keep the original image
+// while it is converted to the extent layout. The copy is made under a
+// temporary name and renamed into place once it is complete.
+static int copyFile(const char *from, const char *to)
+{
+	char buffer[65536];
+	char temporary[64];
+	ssize_t bytes;
+	int in = openat(fs.imageFd, from, O_RDONLY);
+	int out;
+	int res = 0;
+
+	snprintf(temporary, sizeof(temporary), "%s.tmp", to);
+	out = openat(fs.imageFd, temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if(in < 0 || out < 0)
+		res = -EIO;
+	else;
+	while(res == 0 && (bytes = read(in, buffer, sizeof(buffer))) > 0)
+	{
+		if(write(out, buffer, bytes) != bytes)
+			res = -EIO;
+		else;
+	}
+	if(res == 0 && fsync(out) < 0)
+		res = -EIO;
+	else;
+	if(in >= 0)
+		close(in);
+	else;
+	if(out >= 0)
+		close(out);
+	else;
+	if(res == 0 && renameat(fs.imageFd, temporary, fs.imageFd, to) < 0)
+		res = -EIO;
+	else;
+	return res;
+}
+
+// Rewrites an image made with the old linked block layout into the extent
+// layout. Every file is read into memory through its nNextBlock chain, then
+// the allocator is reset and the files are written back as extents. The old
+// .directories and .disk are copied to .directories.chain and .disk.chain
+// first and only removed once everything has reached the disk, so an
+// interrupted conversion is rolled back by cs1550_open_image and retried.
+static int convertChainImage(cs1550_disk_management *manage)
+{
+	cs1550_directory_cache *cache = &fs.directories;
+	char **contents = calloc(cache->nRecords * MAX_FILES_IN_DIR, sizeof(char *));
+	cs1550_disk_block block;
+	int res = 0;
+	int slot;
+	int i;
+
+	#if DEBUGFILE
+	printf("Converting linked block image to extents\n");
+	#endif
+	if(contents == NULL)
+		return -ENOMEM;
+	else;
+	if(copyFile(".directories", ".directories.chain") < 0 || copyFile(".disk", ".disk.chain") < 0)
+	{
+		free(contents);
+		return -EIO;
+	}
+	else;
+
+	//pull every file's data off the old chains
+	for(slot = 0; slot < cache->nRecords && res == 0; slot++)
+	{
+		cs1550_directory_entry *dir = &cache->entries[slot];
+		for(i = 0; i < dir->nFiles && res == 0; i++)
+		{
+			struct cs1550_file_directory *dirFile = dir->files + i;
+			long nextBlock = dirFile->nStartBlock;
+			size_t copied = 0;
+			char *data;
+
+			if(dirFile->fsize == 0)
+				continue;
+			else;
+			data = malloc(dirFile->fsize);
+			if(data == NULL)
+			{
+				res = -ENOMEM;
+				break;
+			}
+			else;
+			contents[slot * MAX_FILES_IN_DIR + i] = data;
+			while(nextBlock > 0 && copied < dirFile->fsize && readBlock(nextBlock, &block) == 0)
+			{
+				size_t bytes = block.size;
+				if(bytes > MAX_DATA_IN_BLOCK)
+					bytes = MAX_DATA_IN_BLOCK;
+				else;
+				if(bytes > dirFile->fsize - copied)
+					bytes = dirFile->fsize - copied;
+				else;
+				memcpy(data + copied, block.data, bytes);
+				copied += bytes;
+				nextBlock = block.nNextBlock;
+			}
+			dirFile->fsize = copied; // a broken chain keeps whatever could be read
+		}
+	}
+
+	//start the allocator over and write every file back as extents. The
+	//bitmap itself is made afterwards by loadAllocator, from the new extents.
+	if(res == 0)
+		res = resetAllocator();
+	else;
+	for(slot = 0; slot < cache->nRecords && res == 0; slot++)
+	{
+		cs1550_directory_entry *dir = &cache->entries[slot];
+		for(i = 0; i < dir->nFiles && res == 0; i++)
+		{
+			struct cs1550_file_directory *dirFile = dir->files + i;
+			cs1550_extent_map *map = &cache->maps[slot * MAX_FILES_IN_DIR + i];
+			char *data = contents[slot * MAX_FILES_IN_DIR + i];
+			long k;
+
+			freeExtentMap(map);
+			map->loaded = 1;
+			dirFile->nStartBlock = -1;
+			while(res == 0 && map->nBlocks * fs.blockSize < (long)dirFile->fsize)
+			{
+				long start;
+				long count = allocateBlocks((dirFile->fsize + fs.blockSize - 1) / fs.blockSize - map->nBlocks, &start);
+				res = count < 0 ? count : appendExtent(map, start, count);
+			}
+			if(res == 0)
+				res = saveExtentMap(map);
+			else;
+			if(res == 0 && map->nExtentBlocks > 0)
+				dirFile->nStartBlock = map->extentBlocks[0];
+			else;
+			for(k = 0; k < map->nExtents && res == 0; k++)
+			{
+				long start = map->fileBlocks[k] * fs.blockSize;
+				long bytes = map->extents[k].nBlocks * fs.blockSize;
+				if(bytes > (long)dirFile->fsize - start)
+					bytes = dirFile->fsize - start;
+				else;
+				if(writeDisk((off_t)map->extents[k].nStartBlock * fs.blockSize, data + start, bytes) < 0)
+					res = -EIO;
+				else;
+			}
+		}
+		if(res == 0)
+			res = writeDirectory(slot);
+		else;
+	}
+
+	for(i = 0; i < cache->nRecords * MAX_FILES_IN_DIR; i++)
+		free(contents[i]);
+	free(contents);
+
+	if(res == 0)
+	{
+		manage->layout = LAYOUT_GEOMETRY;
+		manage->prevAllocations = 1;
+		manage->free = fs.allocator.cursor;
+		manage->bitmapStart = 0;
+		manage->dirty = 1;
+		manage->blockSize = fs.blockSize;
+		manage->nBlocks = fs.nBlocks;
+		res = writeDisk(0, manage, sizeof(cs1550_disk_management));
+	}
+	else;
+	if(res == 0 && (fsync(fs.diskFd) < 0 || fsync(fs.directoriesFd) < 0))
+		res = -EIO;
+	else;
+	if(res == 0)
+	{
+		unlinkat(fs.imageFd, ".disk.chain", 0); // .disk.chain is what marks a conversion as unfinished, so it goes first
+		unlinkat(fs.imageFd, ".directories.chain", 0);
+	}
+	else;
+	return res;
+}
+
+// Formats a disk nothing has been written to yet, giving it the block size
+// asked for with -o block_size and as many blocks as fit in .disk
+static int formatDisk(cs1550_disk_management *manage)
+{
+	long blockSize = options.blockSize;
+	struct stat st;
+
+	if(blockSize < MIN_BLOCK_SIZE || blockSize > MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0)
+	{
+		fprintf(stderr, "cs1550: block_size must be a power of two from %d to %d\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+		return -EINVAL;
+	}
+	else;
+	if(fstat(fs.diskFd, &st) < 0)
+		return -EIO;
+	else;
+
+	memset(manage, 0, sizeof(cs1550_disk_management));
+	manage->layout = LAYOUT_GEOMETRY;
+	manage->blockSize = blockSize;
+	manage->nBlocks = st.st_size / blockSize;
+	setGeometry(manage->blockSize, manage->nBlocks);
+	if(manage->nBlocks < 2 + fs.bitmapBlocks)
+	{
+		fprintf(stderr, "cs1550: .disk is too small for %ld byte blocks\n", blockSize);
+		return -EINVAL;
+	}
+	else;
+	#if DEBUGFILE
+	printf("Formatting %ld blocks of %ld bytes\n", manage->nBlocks, manage->blockSize);
+	#endif
+	return 0;
+}
+
+// Reads the disk management block and makes sure .disk is in the extent
+// layout with its geometry recorded, formatting a fresh disk, recording the
+// fixed geometry of an older extent image and converting one written with
+// the old linked block layout. Then sets up the free space bitmap.
+static int checkLayout()
+{
+	cs1550_disk_management *manage = &fs.management;
+	int res = 0;
+
+	if(readDisk(0, manage, sizeof(cs1550_disk_management)) < 0)
+		return -EIO;
+	else;
+
+	if(manage->layout == LAYOUT_CHAIN && manage->prevAllocations == 0) // nothing has been written yet
+		res = formatDisk(manage);
+	else if(manage->layout == LAYOUT_CHAIN || manage->layout == LAYOUT_EXTENTS)
+	{
+		//older images were always BLOCKS_ON_DISK blocks of BLOCK_SIZE bytes
+		setGeometry(BLOCK_SIZE, BLOCKS_ON_DISK);
+		if(manage->layout == LAYOUT_CHAIN)
+			res = convertChainImage(manage);
+		else;
+		manage->layout = LAYOUT_GEOMETRY;
+		manage->blockSize = BLOCK_SIZE;
+		manage->nBlocks = BLOCKS_ON_DISK;
+		manage->journalStart = 0; // was padding in these images
+		manage->journalBlocks = 0;
+		manage->journalSequence = 0;
+		manage->sharedBlocks = 0;
+		manage->checksumStart = 0;
+		manage->checksumBlocks = 0;
+	}
+	else if(manage->layout == LAYOUT_GEOMETRY && manage->blockSize >= BLOCK_SIZE && manage->blockSize <= MAX_BLOCK_SIZE
+		&& (manage->blockSize & (manage->blockSize - 1)) == 0 && manage->nBlocks > 1)
+		setGeometry(manage->blockSize, manage->nBlocks);
+	else
+		return -EINVAL;
+
+	if(res < 0)
+		return res;
+	else;
+	return loadAllocator();
+}
+
+// Appends printf style text to a growing buffer, keeping *size up to date.
+// Stops adding once memory runs out and leaves *text NULL.
+static void appendText(char **text, long *size, long *capacity, const char *format, ...)
+{
+	va_list args;
+	long needed;
+
+	if(*text == NULL)
+		return;
+	else;
+	va_start(args, format);
+	needed = vsnprintf(*text + *size, *capacity - *size, format, args);
+	va_end(args);
+	if(*size + needed >= *capacity)
+	{
+		char *grown;
+		while(*size + needed >= *capacity)
+			*capacity *= 2;
+		grown = realloc(*text, *capacity);
+		if(grown == NULL)
+		{
+			free(*text);
+			*text = NULL;
+			return;
+		}
+		else;
+		*text = grown;
+		va_start(args, format);
+		vsnprintf(*text + *size, *capacity - *size, format, args);
+		va_end(args);
+	}
+	else;
+	*size += needed;
+}
+
+// Writes out everything in fs.stats along with the allocator, block cache and
+// journal counters, as the contents of CS1550_STATS_PATH. Returns the text, which the
+// caller frees, and stores its length in *size; NULL if there was no memory.
+static char *renderStats(long *size)
+{
+	cs1550_stats *stats = &fs.stats;
+	long capacity = 4096;
+	char *text = malloc(capacity);
+	cs1550_io_stats *io[2] = { &stats->disk, &stats->directories };
+	const char *ioNames[2] = { ".disk", ".directories" };
+	long nFree;
+	int op;
+	int i;
+
+	*size = 0;
+	appendText(&text, size, &capacity, "%-8s %10s %8s %10s  latency histogram, calls under each limit in us\n",
+		"op", "calls", "errors", "avg us");
+	for(op = 0; op < N_OPS; op++)
+	{
+		cs1550_op_stats *opStats = &stats->ops[op];
+		unsigned long calls = counter(&opStats->calls);
+		appendText(&text, size, &capacity, "%-8s %10lu %8lu %10.1f", opNames[op], calls,
+			counter(&opStats->errors), calls > 0 ? counter(&opStats->nanoseconds) / 1000.0 / calls : 0.0);
+		for(i = 0; i < LATENCY_BUCKETS; i++)
+		{
+			unsigned long n = counter(&opStats->latency[i]);
+			if(n == 0)
+				continue;
+			else if(i < LATENCY_BUCKETS - 1)
+				appendText(&text, size, &capacity, " <%lu:%lu", 1UL << i, n);
+			else
+				appendText(&text, size, &capacity, " >=%lu:%lu", 1UL << (i - 1), n);
+		}
+		appendText(&text, size, &capacity, "\n");
+	}
+
+	for(i = 0; i < 2; i++)
+		appendText(&text, size, &capacity, "%s: %lu reads %lu bytes, %lu writes %lu bytes, %lu syncs\n", ioNames[i],
+			counter(&io[i]->reads), counter(&io[i]->readBytes), counter(&io[i]->writes),
+			counter(&io[i]->writeBytes), counter(&io[i]->syncs));
+
+	pthread_mutex_lock(&fs.allocatorLock);
+	nFree = fs.allocator.nFree;
+	pthread_mutex_unlock(&fs.allocatorLock);
+	appendText(&text, size, &capacity, "allocator: %lu allocations %lu blocks, %lu frees %lu blocks, %ld of %ld blocks free\n",
+		counter(&stats->allocations), counter(&stats->allocatedBlocks), counter(&stats->frees),
+		counter(&stats->freedBlocks), nFree, fs.nBlocks);
+	for(i = 0; i < ALLOCATION_POOLS; i++)
+	{
+		cs1550_allocation_pool *pool = &fs.pools[i];
+		pthread_mutex_lock(&pool->lock);
+		if(pool->allocations > 0)
+			appendText(&text, size, &capacity, "pool %d: %lu allocations, %lu blocks, %lu refills, %lu returns, %ld reserved\n",
+				i, pool->allocations, pool->blocks, pool->refills, pool->returns, pool->nBlocks);
+		else;
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	appendText(&text, size, &capacity, "compression: %s, %lu units packed from %lu blocks into %lu, %lu incompressible, %lu unpacked\n",
+		options.compress ? "on" : "off", counter(&stats->packedUnits), counter(&stats->packedBlocks),
+		counter(&stats->storedBlocks), counter(&stats->incompressible), counter(&stats->unpackedUnits));
+
+	pthread_mutex_lock(&fs.dedup.lock);
+	appendText(&text, size, &capacity, "dedup: %s, %lu blocks hashed, %lu shared, %lu copied, %ld blocks in use more than once, %ld indexed\n",
+		options.dedup ? "on" : "off", fs.dedup.hashed, fs.dedup.deduplicated, fs.dedup.copies, fs.dedup.nShared, fs.dedup.nIndexed);
+	pthread_mutex_unlock(&fs.dedup.lock);
+
+	appendText(&text, size, &capacity, "checksums: %s, %lu blocks summed, %lu verified, %lu bad, %lu ms; scrub: %lu passes, %lu blocks\n",
+		fs.checksums.sums != NULL ? "on" : "off", counter(&stats->summedBlocks), counter(&stats->verifiedBlocks),
+		counter(&stats->badBlocks), counter(&stats->checksumNanoseconds) / 1000000,
+		counter(&stats->scrubPasses), counter(&stats->scrubbedBlocks));
+
+	pthread_mutex_lock(&fs.cacheLock);
+	appendText(&text, size, &capacity, "cache: %ld blocks, %lu hits, %lu misses, %lu evictions, %lu writebacks, %lu read ahead\n",
+		fs.cache.nEntries, fs.cache.hits, fs.cache.misses, fs.cache.evictions, fs.cache.writebacks, fs.cache.readAheads);
+	pthread_mutex_unlock(&fs.cacheLock);
+
+	pthread_mutex_lock(&fs.journal.lock);
+	appendText(&text, size, &capacity, "journal: %s, %lu transactions, %lu records, %lu checkpoints, %ld pending\n",
+		fs.journal.active ? "on" : "off", fs.journal.commits, fs.journal.records,
+		counter(&fs.journal.checkpoints), fs.journal.nPending);
+	pthread_mutex_unlock(&fs.journal.lock);
+	return text;
+}
+
+/*
+ * Called whenever the system wants to know the file attributes, including
+ * simply whether the file exists or not. 
+ *
+ * man -s 2 stat will show the fields of a stat structure
+ */
+static int getAttributes(const char *path, struct stat *stbuf)
+{
+	char name[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	int parent;
+	int directory = -1;
+	int res = 0;
+
+	memset(stbuf, 0, sizeof(struct stat));
+	
+	#if DEBUGFILE
+	printf("Beginning getattr\n");
+	#endif
+	
+	//is path the root dir?
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} 
+	
+	//like a file in /proc the statistics report no size, their text is only
+	//made when they are opened and read with direct_io up to where it ends
+	else if(strcmp(path, CS1550_STATS_PATH) == 0)
+	{
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+	}
+	
+	else 
+	{
+		#if DEBUGFILE
+		printf("Walking path\n");
+		#endif
+		pthread_rwlock_rdlock(&fs.namespaceLock);
+		res = walkPath(path, &parent, name, extension);
+		if(res == 0 && extension[0] == '\0')
+			directory = findDirectory(parent, name);
+		else;
+		pthread_rwlock_unlock(&fs.namespaceLock);
+		
+		if(res < 0) // a directory on the way doesn't exist
+		{
+			#if DEBUGFILE
+			printf("Path is not in the cache, returning %d\n", res);
+			#endif
+			return res;
+		}
+		else;
+		
+		//Check if name is subdirectory
+		if(directory >= 0) 
+		{
+			stbuf->st_mode = S_IFDIR | 0755;
+			stbuf->st_nlink = 2;
+			res = 0; //no error
+		}
+		
+		else if(parent == ROOT_DIRECTORY) // only directories are kept in the root
+			res = -ENOENT;
+		
+		else // must be a file
+		{
+			int slot;
+			int i;
+			
+			lockDirectory(parent, 0);
+			slot = findFile(parent, name, extension, &i);
+			if(slot < 0) // file doesn't exist
+				res = -ENOENT;
+			else
+			{
+				//regular file, probably want to be read and write
+				stbuf->st_mode = S_IFREG | 0666; 
+				stbuf->st_nlink = 1; //file links
+				pthread_mutex_lock(&fs.directories.locks[slot]->recordLock);
+				stbuf->st_size = fs.directories.entries[slot].files[i].fsize; //file size - make sure you replace with real size!
+				pthread_mutex_unlock(&fs.directories.locks[slot]->recordLock);
+				res = 0; // no error
+			}
+			unlockDirectory(parent);
+		}
+		
+	
+	}
+	return res;
+}
+
+/* 
+ * Called whenever the contents of a directory are desired. Could be from an 'ls'
+ * or could even be when a user hits TAB to do autocompletion. Hands every
+ * name in the directory to fn.
+ */
+static int listDirectory(const char *path, cs1550_list_fn fn, void *arg)
+{
+	if(strcmp(path, "/") == 0) // need to show all subdirectories
+	{
+		int i;
+		fn(arg, STATS_NAME);
+		pthread_rwlock_rdlock(&fs.namespaceLock);
+		for(i = 0; i < fs.directories.nDirectories; i++)
+			if(fn(arg, fs.directories.entries[fs.directories.directories[i]].dname) != 0)
+				break;
+			else;
+		pthread_rwlock_unlock(&fs.namespaceLock);
+	}
+	
+	else // need to show all files and directories within this subdirectory
+	{
+		char name[MAX_FILENAME + 1];
+		char extension[MAX_EXTENSION + 1];
+		int parent;
+		int head = -1;
+		pthread_rwlock_rdlock(&fs.namespaceLock);
+		if(walkPath(path, &parent, name, extension) == 0 && extension[0] == '\0')
+			head = findDirectory(parent, name);
+		else;
+		pthread_rwlock_unlock(&fs.namespaceLock);
+		if(head < 0) // If we never found a subdirectory matching the one given return error
+			return -ENOENT;
+		else
+		{
+			lockDirectory(head, 0);
+			cs1550_directory_index *index = fs.directories.indexes[head];
+			struct cs1550_file_directory *dirFile;
+			int stop = 0;
+			int r;
+			char fileName[20];
+			// The records in the order they are in .directories, and their files in order
+			for(r = 0; r < index->nRecords && !stop; r++)
+			{
+				cs1550_directory_entry *entry = &fs.directories.entries[index->records[r]];
+				int i = 0;
+				while(i < entry->nFiles)
+				{
+					dirFile = entry->files + i;
+					strcpy(fileName, dirFile->fname);
+					if(strcmp(dirFile->fext, "") != 0 && !isDirectoryFile(dirFile)) // If file has an extension then include that when giving its name
+					{
+						strcat(fileName, ".");
+						strcat(fileName, dirFile->fext);
+					}
+					else;
+					if(fn(arg, fileName) != 0)
+					{
+						stop = 1;
+						break;
+					}
+					else;
+					i++;
+				}
+			}
+			unlockDirectory(head);
+		}
+	}
+	return 0;
+}
+
+// Adds an entry to the directory whose first record is in head, in the
+// record that became free last, and indexes it. The caller has made sure
+// one of its records has room and holds the directory exclusively, or the
+// namespace lock exclusively. Returns the slot of the record.
+static int insertFile(int head, const char *name, const char *extension, long nStartBlock)
+{
+	cs1550_directory_index *index = fs.directories.indexes[head];
+	int slot = index->open[index->nOpen - 1];
+	cs1550_directory_entry *dir = &fs.directories.entries[slot];
+	struct cs1550_file_directory *dirFile = dir->files + dir->nFiles;
+	int res;
+
+	#if DEBUGFILE
+	printf("Record %d has %d files, making file in %d index of array\n", slot, dir->nFiles, dir->nFiles);
+	#endif
+	strcpy(dirFile->fname, name);
+	strcpy(dirFile->fext, extension);
+	dirFile->fsize = 0;
+	dirFile->nStartBlock = nStartBlock;
+
+	res = indexFile(index, slot, dir->nFiles);
+	if(res < 0)
+	{
+		memset(dirFile, 0, sizeof(struct cs1550_file_directory));
+		return res;
+	}
+	else;
+	fs.directories.maps[slot * MAX_FILES_IN_DIR + dir->nFiles].generation = __sync_add_and_fetch(&fs.generations, 1);
+	dir->nFiles += 1;
+	if(dir->nFiles == MAX_FILES_IN_DIR)
+		index->nOpen--;
+	else;
+	return slot;
+}
+
+/* 
+ * Creates a directory. A directory in the root gets a record named after
+ * it. One anywhere else gets a record named after its own slot and an
+ * entry in its parent pointing there.
+ */
+static int makeDirectory(const char *path)
+{
+	char name[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	char key[MAX_FILENAME + 1];
+	long sequence = 0;
+	int parent;
+	int slot;
+	int i;
+	int res;
+	
+	if(strcmp(path, "/") == 0) // No new directory given
+		 return -EEXIST;
+	else if(strchr(strrchr(path, '/'), '.') != NULL) // directory names can't have a '.' in them
+		return -EPERM;
+	else;
+	
+	//adding a directory can move the cache arrays, so nothing else may be looking at them
+	pthread_rwlock_wrlock(&fs.namespaceLock);
+	res = walkPath(path, &parent, name, extension);
+	if(res == 0 && findDirectory(parent, name) >= 0) // Directory already exists
+		res = -EEXIST;
+	else if(res == 0 && parent == ROOT_DIRECTORY)
+	{
+		slot = appendRecord(name);
+		res = slot < 0 ? slot : 0;
+	}
+	else if(res == 0 && findFile(parent, name, "", &i) >= 0) // a file has the name
+		res = -EEXIST;
+	else if(res == 0)
+	{
+		int child;
+		// room in the parent first, so the new directory is never left without an entry there
+		strcpy(key, fs.directories.entries[parent].dname);
+		res = fs.directories.indexes[parent]->nOpen > 0 ? 0 : appendRecord(key);
+		if(res >= 0 && snprintf(key, sizeof(key), "/%d", fs.directories.nRecords) >= (int)sizeof(key))
+			res = -ENOSPC;
+		else;
+		child = res < 0 ? res : appendRecord(key);
+		slot = child < 0 ? child : insertFile(parent, name, DIRECTORY_EXTENSION, child);
+		res = slot < 0 ? slot : addDentry(parent, name, child);
+		if(res == 0)
+			sequence = logDirectory(slot);
+		else;
+		if(sequence < 0)
+			res = sequence;
+		else;
+	}
+	else;
+	pthread_rwlock_unlock(&fs.namespaceLock);
+	return res < 0 ? res : commitJournal(sequence);
+}
+
+/* 
+ * Does the actual creation of a file.
+ *
+ */
+static int createFile(const char *path)
+{
+	char name[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	char key[MAX_FILENAME + 1];
+	cs1550_directory_index *index;
+	long sequence;
+	int parent;
+	int slot;
+	int i;
+	int res;
+
+	#if DEBUGFILE
+	printf("Beginning mknod\n");
+	#endif
+	pthread_rwlock_rdlock(&fs.namespaceLock);
+	res = walkPath(path, &parent, name, extension);
+	pthread_rwlock_unlock(&fs.namespaceLock);
+	if(res < 0) // a directory on the way doesn't exist, or the name is over the 8.3 limit
+		return res;
+	else if(parent == ROOT_DIRECTORY) // No directory given, tried to create a file in root
+		return -EPERM;
+	else;
+	
+	#if DEBUGFILE
+	printf("Directory record %d, name given was %s\nExtension given was %s\n", parent, name, extension);
+	#endif
+	
+	lockDirectory(parent, 1);
+	index = fs.directories.indexes[parent];
+	
+	// When every record of the directory is full it gets another one.
+	// That can move the cache arrays, so it is done with the namespace
+	// lock exclusive and everything is looked at again afterwards.
+	while((slot = findFile(parent, name, extension, &i)) < 0 && index->nOpen == 0)
+	{
+		int added = 0;
+		strcpy(key, fs.directories.entries[parent].dname);
+		unlockDirectory(parent);
+		pthread_rwlock_wrlock(&fs.namespaceLock);
+		if(index->nOpen == 0)
+			added = appendRecord(key);
+		else;
+		pthread_rwlock_unlock(&fs.namespaceLock);
+		if(added < 0)
+			return added;
+		else;
+		lockDirectory(parent, 1);
+	}
+	if(slot >= 0 || (extension[0] == '\0' && findDirectory(parent, name) >= 0))
+	{
+		unlockDirectory(parent);
+		return -EEXIST;
+	}
+	else;
+	
+	#if DEBUGFILE
+	printf("File does not exist, creating file\n");
+	#endif
+	slot = insertFile(parent, name, extension, -1);
+	if(slot < 0)
+	{
+		unlockDirectory(parent);
+		return slot;
+	}
+	else;
+	
+	//wait for the journal without the lock so other creates can share the commit
+	sequence = logDirectory(slot);
+	unlockDirectory(parent);
+	return sequence < 0 ? sequence : commitJournal(sequence);
+}
+
+/*
+ * Deletes a file. Its extent blocks and data blocks go back to the free
+ * space bitmap so later writes can use them again.
+ */
+static int removeFile(const char *path)
+{
+	int slot;
+	int i;
+	int res = resolvePath(path, &slot, &i, 1);
+	cs1550_directory_index *index;
+	cs1550_directory_entry *dir;
+	cs1550_extent_map *maps;
+	cs1550_extent_map *map;
+	cs1550_extent_map removed;
+	long sequence;
+	long k;
+	int last;
+
+	//holding the directory exclusively also keeps every file in it idle
+	if(res < 0)
+		return res;
+	else;
+	index = fs.directories.indexes[fs.directories.heads[slot]];
+	dir = &fs.directories.entries[slot];
+	maps = &fs.directories.maps[slot * MAX_FILES_IN_DIR];
+	map = getExtentMap(slot, i);
+	if(map == NULL)
+	{
+		unlockDirectory(slot);
+		return -EIO;
+	}
+	else;
+
+	removed = *map;
+
+	// Move the record's last file into the gap, so only its bucket in the
+	// index changes. Its handles still have the old index and find the file
+	// again by name and generation in lockHandle.
+	last = dir->nFiles - 1;
+	unindexFile(index, dir->files[i].fname, dir->files[i].fext);
+	if(i < last)
+	{
+		index->buckets[findBucket(index, dir->files[last].fname, dir->files[last].fext)] = slot * MAX_FILES_IN_DIR + i + 1;
+		dir->files[i] = dir->files[last];
+		maps[i] = maps[last];
+	}
+	else;
+	if(dir->nFiles == MAX_FILES_IN_DIR)
+		index->open[index->nOpen++] = slot;
+	else;
+	dir->nFiles--;
+	memset(dir->files + last, 0, sizeof(struct cs1550_file_directory));
+	memset(maps + last, 0, sizeof(cs1550_extent_map));
+
+	sequence = logDirectory(slot);
+	unlockDirectory(slot);
+	res = sequence < 0 ? sequence : commitJournal(sequence);
+
+	// The blocks are only reused once the record without the file is durable,
+	// so a crash can never leave the file pointing at another file's blocks
+	for(k = 0; k < removed.nExtents; k++)
+	{
+		if(!isHole(&removed.extents[k]))
+			freeBlocks(removed.extents[k].nStartBlock, diskBlocksOf(&removed.extents[k]));
+		else;
+	}
+	for(k = 0; k < removed.nExtentBlocks; k++)
+		freeBlocks(removed.extentBlocks[k], 1);
+	freeExtentMap(&removed);
+	return res;
+}
+
+// Reads from a file whose directory is locked shared and whose file lock is
+// held shared, with its extent map already loaded. Does the work of readHandle.
+static int readFile(int slot, int i, cs1550_file_handle *handle, char *buf, size_t size, off_t offset)
+{
+	cs1550_directory_entry *dir = &fs.directories.entries[slot];
+	struct cs1550_file_directory *dirFile = dir->files + i;
+	cs1550_extent_map *map = &fs.directories.maps[slot * MAX_FILES_IN_DIR + i];
+	long sizeRead;
+	
+	//check that offset is < the file size, and don't read past the end of it
+	if(offset >= dirFile->fsize)
+		return 0;
+	else if(size > dirFile->fsize - offset)
+		size = dirFile->fsize - offset;
+	else;
+	
+	//a small file's data came in with its extent map
+	if(map->inlineData != NULL)
+	{
+		memcpy(buf, map->inlineData + offset, size);
+		return size;
+	}
+	else;
+	
+	//read in data
+	#if DEBUGFILEREAD
+	printf("Beginning read loop\n");
+	#endif
+	sizeRead = readExtents(map, buf, size, offset);
+	if(sizeRead < 0)
+		return sizeRead;
+	else;
+	
+	//a read that carries on where the last one ended grows the read-ahead
+	//window and anything else shuts it off. More is read ahead once the
+	//reader gets within half a window of where the last read-ahead stopped.
+	//The blocks are read after handle->lock is let go, since nothing may be
+	//locked under it, and only count as read ahead once they are cached.
+	if(fs.cache.nEntries > 0)
+	{
+		long endBlock = (offset + sizeRead + fs.blockSize - 1) / fs.blockSize;
+		long limit = fs.cache.nEntries / 4;
+		long first = 0;
+		long end = 0;
+
+		pthread_mutex_lock(&handle->lock);
+		if(offset == handle->nextOffset && offset > 0)
+			handle->window = handle->window > 0 ? handle->window * 2 : READAHEAD_MIN;
+		else
+		{
+			handle->window = 0;
+			handle->readAheadEnd = 0;
+		}
+		if(handle->window > READAHEAD_MAX)
+			handle->window = READAHEAD_MAX;
+		else;
+		if(handle->window > limit)
+			handle->window = limit;
+		else;
+		handle->nextOffset = offset + sizeRead;
+
+		if(handle->window > 0 && handle->readAheadEnd - endBlock < handle->window / 2)
+		{
+			first = handle->readAheadEnd > endBlock ? handle->readAheadEnd : endBlock;
+			end = endBlock + handle->window;
+		}
+		else;
+		pthread_mutex_unlock(&handle->lock);
+
+		//a read-ahead that fails is tried again at the next read
+		if(end > first)
+		{
+			#if DEBUGFILEREAD
+			printf("Reading ahead from file block %ld up to %ld\n", first, end);
+			#endif
+			if(readAhead(map, first, end - first) == 0)
+			{
+				pthread_mutex_lock(&handle->lock);
+				if(handle->window > 0 && handle->readAheadEnd < end)
+					handle->readAheadEnd = end;
+				else;
+				pthread_mutex_unlock(&handle->lock);
+			}
+			else;
+		}
+		else;
+	}
+	else;
+	
+	return sizeRead;
+}
+
+/* 
+ * Read size bytes from file into buf starting from offset
+ *
+ */
+static int readHandle(cs1550_file_handle *handle, char *buf, size_t size, off_t offset)
+{
+	int res;
+	int slot;
+	int i;
+	pthread_rwlock_t *lock;
+	
+	#if DEBUGFILEREAD
+	printf("Size to read is %d\n", size);
+	#endif
+	
+	//the statistics are read from the copy made in open
+	if(handle->stats != NULL)
+	{
+		res = offset < handle->statsSize ? (handle->statsSize - offset < (long)size ? handle->statsSize - offset : (long)size) : 0;
+		memcpy(buf, handle->stats + offset, res);
+		return res;
+	}
+	else;
+	
+	//the file was looked up once in open
+	res = lockHandle(handle, &slot, &i);
+	if(res < 0)
+		return res;
+	else;
+	
+	//reads of the same file run side by side, but loading its extent map
+	//needs the file to itself
+	lock = fileLock(slot, i);
+	pthread_rwlock_rdlock(lock);
+	if(!fs.directories.maps[slot * MAX_FILES_IN_DIR + i].loaded)
+	{
+		pthread_rwlock_unlock(lock);
+		pthread_rwlock_wrlock(lock);
+		res = getExtentMap(slot, i) == NULL ? -EIO : 0;
+		pthread_rwlock_unlock(lock);
+		pthread_rwlock_rdlock(lock);
+	}
+	else;
+	if(res == 0)
+		res = readFile(slot, i, handle, buf, size, offset);
+	else;
+	pthread_rwlock_unlock(lock);
+	unlockDirectory(slot);
+	return res;
+}
+
+// Gives the file blocks from first up to end that are in holes blocks of
+// their own, leaving the rest of each hole as it is. Everything is allocated
+// before any hole changes, so a disk that fills up leaves the file as it was.
+static int fillHoles(cs1550_extent_map *map, long first, long end)
+{
+	cs1550_extent *runs;
+	cs1550_extent *with;
+	long bytes;
+	int scratch;
+	long nRuns = 0;
+	long need = 0;
+	long got = 0;
+	long used = 0;
+	long fileBlock;
+	long k;
+	int res = 0;
+
+	for(fileBlock = first; fileBlock < end; fileBlock = map->fileBlocks[k] + fileBlocksOf(&map->extents[k]))
+	{
+		k = findExtent(map, fileBlock);
+		if(isHole(&map->extents[k]))
+			need += (map->fileBlocks[k] + map->extents[k].nBlocks < end ? map->fileBlocks[k] + map->extents[k].nBlocks : end) - fileBlock;
+		else;
+	}
+	if(need == 0)
+		return 0;
+	else;
+	//every run has at least one block, and so does every piece of a hole.
+	//Only writes too big for the scratch arena go to malloc.
+	bytes = 2 * (need + 1) * sizeof(cs1550_extent);
+	runs = arenaPush(bytes);
+	scratch = runs != NULL;
+	if(runs == NULL && (runs = malloc(bytes)) == NULL)
+		return -ENOMEM;
+	else;
+	with = runs + need + 1;
+	while(got < need && res == 0)
+	{
+		long count = poolAllocate(need - got, &runs[nRuns].nStartBlock);
+		if(count < 1)
+			res = -ENOSPC;
+		else
+		{
+			runs[nRuns++].nBlocks = count;
+			got += count;
+		}
+	}
+	if(res < 0)
+	{
+		for(k = 0; k < nRuns; k++)
+			freeBlocks(runs[k].nStartBlock, runs[k].nBlocks);
+	}
+	else;
+
+	//each part of a hole the write covers becomes however many runs it takes
+	for(fileBlock = first; fileBlock < end && res == 0; fileBlock = map->fileBlocks[k] + fileBlocksOf(&map->extents[k]))
+	{
+		long length;
+		long n = 0;
+		k = findExtent(map, fileBlock);
+		if(!isHole(&map->extents[k]))
+			continue;
+		else if((res = splitExtent(map, fileBlock)) < 0 || (res = splitExtent(map, end)) < 0)
+			break;
+		else;
+		k = findExtent(map, fileBlock);
+		for(length = map->extents[k].nBlocks; length > 0; n++)
+		{
+			with[n].nStartBlock = runs[0].nStartBlock + used;
+			with[n].nBlocks = runs[0].nBlocks - used < length ? runs[0].nBlocks - used : length;
+			length -= with[n].nBlocks;
+			used += with[n].nBlocks;
+			if(used == runs[0].nBlocks)
+			{
+				memmove(runs, runs + 1, --nRuns * sizeof(cs1550_extent));
+				used = 0;
+			}
+			else;
+		}
+		res = replaceExtents(map, k, k + 1, with, n);
+	}
+	if(scratch)
+		arenaPop(bytes);
+	else
+		free(runs);
+	return res;
+}
+
+// Writes zeros over the bytes of a file from from up to to, which lie in one
+// plain block. valid is how much of that block's extent held file data.
+static int zeroRange(cs1550_extent_map *map, long from, long to, long valid)
+{
+	long k = findExtent(map, from / fs.blockSize);
+	char *zeros = arenaPush(to - from);
+	int res;
+
+	if(zeros == NULL)
+		return -ENOMEM;
+	else;
+	memset(zeros, 0, to - from);
+	res = writeRun(map->extents[k].nStartBlock, from - map->fileBlocks[k] * fs.blockSize, zeros, to - from,
+		valid - map->fileBlocks[k] * fs.blockSize) == to - from ? 0 : -EIO;
+	arenaPop(to - from);
+	return res;
+}
+
+// Writes to the data blocks of a file whose extent map is loaded, allocating
+// the ones it doesn't have yet. startSize is the file's size before the write.
+// A write that starts past the end of the file leaves a hole before it, and
+// one into a hole only gets blocks for what it covers.
+// Returns how much was written, which is less than size if the disk fills up.
+static long writeBlocks(cs1550_extent_map *map, cs1550_file_handle *handle, const char *buf, size_t size, off_t offset, size_t startSize)
+{
+	long sizeWritten = 0;
+	long blocksNeeded;
+	long startBlocks = map->nBlocks;
+	long block = offset / fs.blockSize;
+	long first = block;
+	long last = (offset + size - 1) / fs.blockSize;
+	int zeroHead;
+	int zeroTail;
+	int res;
+	
+	if(size == 0)
+		return 0;
+	else;
+
+	//data is only written to plain blocks, so compressed units in the way are
+	//unpacked first. The next flush compresses them again.
+	if(map->compressFrom > block)
+		map->compressFrom = block;
+	else;
+	if(map->dedupFrom > block)
+		map->dedupFrom = block;
+	else;
+	while(block < map->nBlocks && block * fs.blockSize < offset + (long)size)
+	{
+		long k = findExtent(map, block);
+		if(map->extents[k].nBlocks < 0 && (res = unpackUnit(map, k, handle)) < 0)
+			return res;
+		else;
+		block = map->fileBlocks[k] + fileBlocksOf(&map->extents[k]);
+	}
+	//or shared by another extent, so shared blocks in the way are copied
+	if(fs.dedup.active && (res = unshareBlocks(map, handle, offset, size)) < 0)
+		return res;
+	else;
+
+	//a block the file gets now that the write only covers part of has zeros
+	//in the rest, where that is inside the file
+	zeroHead = offset % fs.blockSize != 0 && blocksMissing(map, first, 1);
+	zeroTail = (offset + size) % fs.blockSize != 0 && (long)startSize > offset + (long)size
+		&& blocksMissing(map, last, 1);
+	if(first > map->nBlocks && appendExtent(map, 0, first - map->nBlocks) < 0)
+		return -ENOMEM;
+	else;
+	if((res = fillHoles(map, first, last + 1 < map->nBlocks ? last + 1 : map->nBlocks)) < 0)
+		return res;
+	else;
+	
+	//make sure the file has blocks for everything we're about to write
+	blocksNeeded = (offset + size + fs.blockSize - 1) / fs.blockSize;
+	while(map->nBlocks < blocksNeeded)
+	{
+		long newBlock;
+		long count = poolAllocate(blocksNeeded - map->nBlocks, &newBlock);
+		#if DEBUGFILEWRITE
+		printf("Allocated %ld blocks at %ld\n", count, newBlock);
+		#endif
+		if(count < 0)
+		{
+			#if DEBUGALLOCATE
+			printf("No more space for allocation\n");
+			#endif
+			break; // Out of space on disk, only write what fits
+		}
+		else if(appendExtent(map, newBlock, count) < 0)
+		{
+			freeBlocks(newBlock, count);
+			break;
+		}
+		else;
+	}
+	if(map->nBlocks * fs.blockSize < offset + (long)size)
+		size = map->nBlocks * fs.blockSize > offset ? map->nBlocks * fs.blockSize - offset : 0;
+	else;
+	//with nothing to write the hole in front of it goes again
+	if(size == 0)
+		return cutExtents(map, startBlocks, handle);
+	else;
+	
+	//new blocks have to be in the extent list before anything points at them
+	if(saveExtentMap(map) < 0)
+		return -ENOSPC;
+	else;
+
+	//a write that starts past the end of the file clears what is left of
+	//the file's last block up to it, and new blocks are cleared where the
+	//write doesn't cover them. fillHoles gets every block it needs or none,
+	//so size was only cut short if the write ends past the old end of the
+	//file, where the tail doesn't need clearing.
+	if((long)startSize < offset && startSize % fs.blockSize != 0)
+	{
+		long gapEnd = (startSize / fs.blockSize + 1) * fs.blockSize;
+		if((res = zeroRange(map, startSize, gapEnd < offset ? gapEnd : offset, startSize)) < 0)
+			return res;
+		else;
+	}
+	else;
+	if(zeroHead && (res = zeroRange(map, first * fs.blockSize, offset, 0)) < 0)
+		return res;
+	else;
+	if(zeroTail && (res = zeroRange(map, offset + size, (last + 1) * fs.blockSize, 0)) < 0)
+		return res;
+	else;
+	
+	//write data, one writeRun for the part of the request in each extent
+	#if DEBUGFILE
+	printf("Beginning write loop\n");
+	#endif
+	while(sizeWritten < size)
+	{
+		long position = offset + sizeWritten;
+		long k = findExtent(map, position / fs.blockSize);
+		long inExtent = position - map->fileBlocks[k] * fs.blockSize;
+		long toWrite = map->extents[k].nBlocks * fs.blockSize - inExtent;
+		ssize_t bytes;
+		
+		if(toWrite > size - sizeWritten)
+			toWrite = size - sizeWritten;
+		else;
+		
+		#if DEBUGFILEWRITE
+		printf("Writing %ld bytes to extent %ld at block %ld\n", toWrite, k, map->extents[k].nStartBlock);
+		#endif
+		bytes = writeRun(map->extents[k].nStartBlock, inExtent, buf + sizeWritten, toWrite,
+			(long)startSize - map->fileBlocks[k] * fs.blockSize);
+		if(bytes <= 0)
+			break;
+		else;
+		sizeWritten += bytes;
+	}
+	
+	return sizeWritten;
+}
+
+// Writes to a file whose directory is locked shared and whose file lock is
+// held exclusively. Does the work of writeHandle.
+static int writeFile(int slot, int i, cs1550_file_handle *handle, const char *buf, size_t size, off_t offset)
+{
+	cs1550_directory_locks *locks = fs.directories.locks[slot];
+	long sizeWritten;
+	long startBlock;
+	size_t startSize;
+	int changed;
+	int res = 0;
+	cs1550_directory_entry *dir = &fs.directories.entries[slot];
+	struct cs1550_file_directory *dirFile = dir->files + i;
+	cs1550_extent_map *map = getExtentMap(slot, i);
+	
+	if(map == NULL)
+		return -EIO;
+	else;
+	
+	startSize = dirFile->fsize;
+	startBlock = dirFile->nStartBlock;
+	
+	//a file that starts out small keeps its data in its extent block until
+	//it outgrows it, see cs1550_extent_block
+	if(map->inlineData == NULL && map->nBlocks == 0 && size > 0 && offset + (long)size <= fs.inlineBytes)
+		res = makeInline(map);
+	else if(map->inlineData != NULL && offset + (long)size > fs.inlineBytes)
+		res = promoteInline(map, startSize);
+	else;
+	if(res < 0)
+		return res;
+	else;
+	
+	if(map->inlineData != NULL)
+	{
+		if(offset > (long)startSize)
+			memset(map->inlineData + startSize, 0, offset - startSize);
+		else;
+		memcpy(map->inlineData + offset, buf, size);
+		if(saveInline(map) < 0)
+			return -EIO;
+		else;
+		sizeWritten = size;
+	}
+	else
+		sizeWritten = writeBlocks(map, handle, buf, size, offset, startSize);
+	if(sizeWritten < 0)
+		return sizeWritten;
+	else if(map->inlineData == NULL && sizeWritten > 0)
+		markWritten(handle, ((long)startSize < offset ? (long)startSize : offset) / fs.blockSize,
+			(offset + sizeWritten + fs.blockSize - 1) / fs.blockSize);
+	else;
+	
+	//the record is shared with the other files in the directory, whose
+	//writers may be copying it out at the same time
+	pthread_mutex_lock(&locks->recordLock);
+	if(map->nExtentBlocks > 0)
+		dirFile->nStartBlock = map->extentBlocks[0];
+	else;
+	if(sizeWritten > 0 && dirFile->fsize < offset + sizeWritten) // size of file only changes if we wrote past the old end of file
+		dirFile->fsize = offset + sizeWritten;
+	else;
+	changed = dirFile->fsize != startSize || dirFile->nStartBlock != startBlock;
+	pthread_mutex_unlock(&locks->recordLock);
+	
+	// The directory record is written out once in flush instead of on every write
+	if(changed)
+	{
+		pthread_mutex_lock(&handle->lock);
+		handle->dirty = 1;
+		pthread_mutex_unlock(&handle->lock);
+	}
+	else;
+	
+	if(sizeWritten == 0 && size > 0)
+		return -ENOSPC;
+	else;
+	return sizeWritten;
+}
+
+/* 
+ * Write size bytes from buf into file starting from offset
+ *
+ */
+static int writeHandle(cs1550_file_handle *handle, const char *buf, size_t size, off_t offset)
+{
+	int res;
+	int slot;
+	int i;
+	
+	#if DEBUGFILE
+	printf("Beginning write\n");
+	#endif
+	
+	if(handle->stats != NULL)
+		return -EACCES;
+	else;
+	
+	//the file was looked up once in open
+	res = lockHandle(handle, &slot, &i);
+	if(res < 0)
+		return res;
+	else;
+	
+	pthread_rwlock_wrlock(fileLock(slot, i));
+	res = writeFile(slot, i, handle, buf, size, offset);
+	pthread_rwlock_unlock(fileLock(slot, i));
+	unlockDirectory(slot);
+	return res;
+}
+
+// Changes the size of a file whose directory is locked shared and whose file
+// lock is held exclusively. Does the work of truncateHandle. A file that grows
+// gets a hole up to its new size. One that shrinks releases the blocks past
+// its new end to the handle and has the rest of its last block cleared, so
+// growing it again shows zeros there.
+static int truncateFile(int slot, int i, cs1550_file_handle *handle, off_t size)
+{
+	cs1550_directory_locks *locks = fs.directories.locks[slot];
+	struct cs1550_file_directory *dirFile = fs.directories.entries[slot].files + i;
+	cs1550_extent_map *map = getExtentMap(slot, i);
+	long keep = (size + fs.blockSize - 1) / fs.blockSize;
+	long startSize;
+	long k;
+	int res = 0;
+
+	if(map == NULL)
+		return -EIO;
+	else;
+	startSize = dirFile->fsize;
+	if(size == startSize)
+		return 0;
+	else;
+
+	//a small file's data stays in its extent block as long as it fits
+	if(map->inlineData != NULL && size > fs.inlineBytes)
+		res = promoteInline(map, startSize);
+	else if(map->inlineData != NULL)
+	{
+		k = size < startSize ? size : startSize;
+		memset(map->inlineData + k, 0, fs.inlineBytes - k);
+		res = saveInline(map) < 0 ? -EIO : 0;
+	}
+	else;
+
+	if(res == 0 && map->inlineData == NULL && size < startSize)
+	{
+		//the new last block is cleared in place, so it mustn't be compressed
+		//or shared with another file
+		if(size < map->nBlocks * fs.blockSize)
+		{
+			k = findExtent(map, size / fs.blockSize);
+			if(map->extents[k].nBlocks < 0 && map->fileBlocks[k] * fs.blockSize < size)
+				res = unpackUnit(map, k, handle);
+			else;
+		}
+		else;
+		if(res == 0 && fs.dedup.active && size % fs.blockSize != 0)
+			res = unshareBlocks(map, handle, size, 1);
+		else;
+		if(res == 0)
+			res = cutExtents(map, keep, handle);
+		else;
+		if(res == 0 && saveExtentMap(map) < 0)
+			res = -ENOSPC;
+		else;
+		if(res == 0 && size % fs.blockSize != 0 && !blocksMissing(map, size / fs.blockSize, 1))
+			res = zeroRange(map, size, keep * fs.blockSize, startSize);
+		else;
+	}
+	else if(res == 0 && map->inlineData == NULL)
+	{
+		//what the old last block holds past the old end isn't file data
+		if(startSize % fs.blockSize != 0 && !blocksMissing(map, startSize / fs.blockSize, 1))
+		{
+			long gapEnd = (startSize / fs.blockSize + 1) * fs.blockSize;
+			res = zeroRange(map, startSize, gapEnd < size ? gapEnd : size, startSize);
+		}
+		else;
+		if(res == 0 && keep > map->nBlocks)
+			res = appendExtent(map, 0, keep - map->nBlocks);
+		else;
+		if(res == 0 && saveExtentMap(map) < 0)
+			res = -ENOSPC;
+		else;
+	}
+	else;
+	if(res < 0)
+		return res;
+	else;
+
+	if(map->inlineData == NULL && size % fs.blockSize != 0)
+		markWritten(handle, size / fs.blockSize, keep);
+	else;
+	if(map->inlineData == NULL && startSize % fs.blockSize != 0)
+		markWritten(handle, startSize / fs.blockSize, startSize / fs.blockSize + 1);
+	else;
+
+	pthread_mutex_lock(&locks->recordLock);
+	if(map->nExtentBlocks > 0)
+		dirFile->nStartBlock = map->extentBlocks[0];
+	else;
+	dirFile->fsize = size;
+	pthread_mutex_unlock(&locks->recordLock);
+
+	pthread_mutex_lock(&handle->lock);
+	handle->dirty = 1;
+	pthread_mutex_unlock(&handle->lock);
+	return 0;
+}
+
+/*
+ * Make the file size bytes long
+ *
+ */
+static int truncateHandle(cs1550_file_handle *handle, off_t size)
+{
+	int res;
+	int slot;
+	int i;
+
+	if(handle->stats != NULL)
+		return -EACCES;
+	else if(size < 0)
+		return -EINVAL;
+	else;
+
+	res = lockHandle(handle, &slot, &i);
+	if(res < 0)
+		return res;
+	else;
+
+	pthread_rwlock_wrlock(fileLock(slot, i));
+	res = truncateFile(slot, i, handle, size);
+	pthread_rwlock_unlock(fileLock(slot, i));
+	unlockDirectory(slot);
+	return res;
+}
+
+// Reads one block for the scrub thread and checks it against its checksum.
+// A block that doesn't match is only bad if no write to .disk was under way
+// while it was read, since a write changes the block and its checksum one
+// after the other; otherwise it is read again, up to SCRUB_RETRIES times.
+static void scrubBlock(long block, char *buf)
+{
+	cs1550_checksums *checksums = &fs.checksums;
+	int tries;
+
+	for(tries = 0; tries <= SCRUB_RETRIES; tries++)
+	{
+		unsigned long started = counter(&checksums->started);
+		int quiet = started == counter(&checksums->finished);
+		uint32_t sum;
+
+		if(pread(fs.diskFd, buf, fs.blockSize, (off_t)block * fs.blockSize) != fs.blockSize)
+			return;
+		else;
+		countIO(&fs.stats.disk, 0, fs.blockSize);
+		__sync_fetch_and_add(&fs.stats.scrubbedBlocks, 1);
+		sum = loadSum(block);
+		if(sum == 0 || blockBit(checksums->changed, block) || blockChecksum(buf) == sum)
+			return;
+		else if(quiet && counter(&checksums->started) == started)
+		{
+			fprintf(stderr, "cs1550: scrub: block %ld does not match its checksum\n", block);
+			__sync_fetch_and_add(&fs.stats.badBlocks, 1);
+			return;
+		}
+		else;
+	}
+}
+
+// The scrub thread. Every SCRUB_INTERVAL_MS it reads the next few blocks
+// that have checksums, -o scrub_kb worth a second, and starts over at the
+// beginning of .disk when it gets to the end. It runs at the lowest
+// priority so it only gets the disk and CPU nobody else wants.
+static void *scrubThread(void *arg)
+{
+	cs1550_checksums *checksums = &fs.checksums;
+	long perTick = options.scrubKB * 1024 / fs.blockSize * SCRUB_INTERVAL_MS / 1000;
+	char *buf = arenaPush(fs.blockSize);
+	long block = 1;
+	(void) arg;
+
+	if(buf == NULL)
+		return NULL;
+	else;
+	if(perTick < 1)
+		perTick = 1;
+	else;
+	#ifdef __linux__
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+	#endif
+
+	pthread_mutex_lock(&checksums->lock);
+	while(!checksums->stopping)
+	{
+		struct timespec deadline;
+		long scrubbed = 0;
+		long looked;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += SCRUB_INTERVAL_MS * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		else;
+		if(pthread_cond_timedwait(&checksums->wake, &checksums->lock, &deadline) != ETIMEDOUT)
+			continue;
+		else;
+		pthread_mutex_unlock(&checksums->lock);
+
+		for(looked = 0; looked < fs.nBlocks && scrubbed < perTick; looked++, block++)
+		{
+			if(block >= fs.nBlocks)
+			{
+				block = 1;
+				__sync_fetch_and_add(&fs.stats.scrubPasses, 1);
+			}
+			else;
+			if(summedBlock(block) && loadSum(block) != 0)
+			{
+				scrubBlock(block, buf);
+				scrubbed++;
+			}
+			else;
+		}
+
+		pthread_mutex_lock(&checksums->lock);
+	}
+	pthread_mutex_unlock(&checksums->lock);
+	arenaPop(fs.blockSize);
+	return NULL;
+}
+
+// Starts the scrub thread once the disk is mounted, unless checksums are off
+// or -o scrub_kb=0 turned it off
+static int startScrub()
+{
+	cs1550_checksums *checksums = &fs.checksums;
+
+	if(checksums->sums == NULL || options.scrubKB == 0)
+		return 0;
+	else;
+	checksums->stopping = 0;
+	if(pthread_create(&checksums->thread, NULL, scrubThread, NULL) != 0)
+		return -EAGAIN;
+	else;
+	checksums->scrubbing = 1;
+	return 0;
+}
+
+// Stops the scrub thread, before anything it reads goes away
+static void stopScrub()
+{
+	cs1550_checksums *checksums = &fs.checksums;
+
+	if(!checksums->scrubbing)
+		return;
+	else;
+	pthread_mutex_lock(&checksums->lock);
+	checksums->stopping = 1;
+	pthread_cond_signal(&checksums->wake);
+	pthread_mutex_unlock(&checksums->lock);
+	pthread_join(checksums->thread, NULL);
+	checksums->scrubbing = 0;
+}
+
+// Frees everything cs1550_open_image set up and closes the backing files,
+// without writing anything. Also cleans up after an open that failed part way.
+static void releaseImage()
+{
+	int i;
+
+	stopScrub();
+	if(fs.diskMap != NULL)
+		munmap(fs.diskMap, fs.diskMapSize);
+	else;
+	fs.diskMap = NULL;
+	free(fs.cache.entries);
+	free(fs.cache.buffer);
+	free(fs.cache.buckets);
+	fs.cache.entries = NULL;
+	fs.cache.buffer = NULL;
+	fs.cache.buckets = NULL;
+	fs.cache.nEntries = 0;
+	free(fs.allocator.bitmap);
+	free(fs.allocator.dirty);
+	fs.allocator.bitmap = NULL;
+	fs.allocator.dirty = NULL;
+	free(fs.dedup.index);
+	free(fs.dedup.indexed);
+	free(fs.dedup.shared);
+	fs.dedup.index = NULL;
+	fs.dedup.indexed = NULL;
+	fs.dedup.shared = NULL;
+	fs.dedup.indexSlots = fs.dedup.nIndexed = 0;
+	fs.dedup.sharedSlots = fs.dedup.nShared = 0;
+	fs.dedup.active = 0;
+	dropChecksums();
+
+	if(fs.directories.maps != NULL)
+	{
+		for(i = 0; i < fs.directories.capacity * MAX_FILES_IN_DIR; i++)
+			freeExtentMap(&fs.directories.maps[i]);
+	}
+	else;
+	if(fs.directories.locks != NULL)
+	{
+		for(i = 0; i < fs.directories.capacity; i++)
+			freeDirectoryLocks(fs.directories.locks[i]);
+	}
+	else;
+	if(fs.directories.indexes != NULL)
+	{
+		for(i = 0; i < fs.directories.capacity; i++)
+			freeDirectoryIndex(fs.directories.indexes[i]);
+	}
+	else;
+	free(fs.directories.maps);
+	free(fs.directories.locks);
+	free(fs.directories.entries);
+	free(fs.directories.heads);
+	free(fs.directories.indexes);
+	free(fs.directories.directories);
+	free(fs.directories.dentries);
+	fs.directories.maps = NULL;
+	fs.directories.locks = NULL;
+	fs.directories.entries = NULL;
+	fs.directories.heads = NULL;
+	fs.directories.indexes = NULL;
+	fs.directories.directories = NULL;
+	fs.directories.dentries = NULL;
+	fs.directories.nRecords = 0;
+	fs.directories.nDirectories = 0;
+	fs.directories.nDentryBuckets = 0;
+	fs.directories.nDentries = 0;
+	fs.directories.capacity = 0;
+
+	if(fs.directoriesFd >= 0)
+		close(fs.directoriesFd);
+	else;
+	if(fs.diskFd >= 0)
+		close(fs.diskFd);
+	else;
+	if(fs.imageFd >= 0)
+		close(fs.imageFd);
+	else;
+	fs.directoriesFd = -1;
+	fs.diskFd = -1;
+	fs.imageFd = AT_FDCWD;
+
+	pthread_rwlock_destroy(&fs.namespaceLock);
+	pthread_mutex_destroy(&fs.allocatorLock);
+	pthread_mutex_destroy(&fs.cacheLock);
+	for(i = 0; i < ALLOCATION_POOLS; i++)
+		pthread_mutex_destroy(&fs.pools[i].lock);
+	pthread_mutex_destroy(&fs.journal.lock);
+	pthread_cond_destroy(&fs.journal.work);
+	pthread_cond_destroy(&fs.journal.done);
+	pthread_mutex_destroy(&fs.checksums.lock);
+	pthread_cond_destroy(&fs.checksums.wake);
+}
+
+/*
+ * Opens .disk and .directories in directory for as long as the image is
+ * open, loads .directories into the directory cache and converts an old
+ * linked block image to extents. Everything else may then be called from
+ * several threads at once, see the locks in cs1550_context.
+ */
+int cs1550_open_image(const char *directory, const cs1550_options *imageOptions)
+{
+	const char *failure = NULL;
+	int res = 0;
+	int i;
+
+	options = imageOptions != NULL ? *imageOptions : defaultOptions;
+	fs.diskFd = -1;
+	fs.directoriesFd = -1;
+	fs.imageFd = AT_FDCWD;
+	pthread_rwlock_init(&fs.namespaceLock, NULL);
+	pthread_mutex_init(&fs.allocatorLock, NULL);
+	pthread_mutex_init(&fs.cacheLock, NULL);
+	for(i = 0; i < ALLOCATION_POOLS; i++)
+		pthread_mutex_init(&fs.pools[i].lock, NULL);
+	pthread_mutex_init(&fs.journal.lock, NULL);
+	pthread_mutex_init(&fs.dedup.lock, NULL);
+	pthread_cond_init(&fs.journal.work, NULL);
+	pthread_cond_init(&fs.journal.done, NULL);
+	pthread_mutex_init(&fs.checksums.lock, NULL);
+	pthread_cond_init(&fs.checksums.wake, NULL);
+	pthread_once(&crcOnce, initCrc);
+
+	if(directory != NULL && (fs.imageFd = open(directory, O_RDONLY | O_DIRECTORY)) < 0)
+	{
+		fs.imageFd = AT_FDCWD;
+		res = -errno;
+		failure = "could not open the image directory";
+	}
+	//a conversion to extents that was interrupted is rolled back and done again
+	else if(faccessat(fs.imageFd, ".disk.chain", F_OK, 0) == 0
+		&& (renameat(fs.imageFd, ".disk.chain", fs.imageFd, ".disk") < 0
+		|| renameat(fs.imageFd, ".directories.chain", fs.imageFd, ".directories") < 0))
+	{
+		res = -errno;
+		failure = "could not roll back an unfinished conversion";
+	}
+	else if((fs.diskFd = openat(fs.imageFd, ".disk", O_RDWR)) < 0)
+	{
+		res = -errno;
+		failure = "could not open .disk";
+	}
+	else if((fs.directoriesFd = openat(fs.imageFd, ".directories", O_RDWR | O_CREAT, 0644)) < 0)
+	{
+		res = -errno;
+		failure = "could not open .directories";
+	}
+	else;
+	if(failure != NULL)
+	{
+		fprintf(stderr, "cs1550: %s: %s\n", failure, strerror(-res));
+		releaseImage();
+		return res;
+	}
+	else;
+	unlinkat(fs.imageFd, ".directories.chain", 0);
+
+	//transactions that made it to the journal but maybe not to .directories
+	if(replayJournal() < 0)
+		failure = "could not replay the journal";
+	else if(loadDirectories() < 0)
+		failure = "could not load .directories";
+	else if((res = checkLayout()) < 0)
+		failure = ".disk is not in a layout this version understands";
+	//the mapping is shared with the kernel's page cache, so a block cache on
+	//top of it would only copy everything twice
+	else if(options.useMmap && mapDisk() < 0)
+		failure = "could not map .disk";
+	else if(initCache(options.useMmap ? 0 : options.cacheKB) < 0)
+		failure = "not enough memory for the block cache";
+	else if(startJournal() < 0)
+		failure = "could not start the journal";
+	else if(startScrub() < 0)
+		failure = "could not start the scrub thread";
+	else;
+	if(failure != NULL)
+	{
+		fprintf(stderr, "cs1550: %s\n", failure);
+		releaseImage();
+		return res < 0 ? res : -EIO;
+	}
+	else;
+	return 0;
+}
+
+/*
+ * Writes back the block cache, commits the journal, saves the free space
+ * bitmap and releases everything cs1550_open_image set up. Anything that
+ * fails is reported on stderr.
+ */
+void cs1550_close_image(void)
+{
+	stopScrub();
+	if(flushCache() < 0)
+		fprintf(stderr, "cs1550: could not write back the block cache\n");
+	else;
+	if(stopJournal() < 0)
+		fprintf(stderr, "cs1550: could not commit the journal, it will be replayed at the next mount\n");
+	else;
+	returnPools();
+	if(saveAllocator(1) < 0 || syncDisk() < 0)
+		fprintf(stderr, "cs1550: could not save the free space bitmap, it will be rebuilt at the next mount\n");
+	else;
+	releaseImage();
+}
+
+/* 
+ * Called when we open a file. The file is looked up once here and a handle
+ * for it is handed back for read, write and flush to use.
+ *
+ */
+static int openFile(const char *path, int flags, cs1550_file_handle **file)
+{
+	cs1550_file_handle *handle;
+	int slot;
+	int index;
+	int res;
+
+	//the statistics are read only, and every open sees them as they were then
+	if(strcmp(path, CS1550_STATS_PATH) == 0)
+	{
+		if((flags & O_ACCMODE) != O_RDONLY)
+			return -EACCES;
+		else;
+		handle = calloc(1, sizeof(cs1550_file_handle));
+		if(handle == NULL)
+			return -ENOMEM;
+		else;
+		handle->stats = renderStats(&handle->statsSize);
+		if(handle->stats == NULL)
+		{
+			free(handle);
+			return -ENOMEM;
+		}
+		else;
+		handle->slot = -1;
+		pthread_mutex_init(&handle->lock, NULL);
+		*file = handle;
+		__sync_fetch_and_add(&fs.openFiles, 1);
+		return 0;
+	}
+	else;
+
+	res = resolvePath(path, &slot, &index, 0);
+	//if we can't find the desired file, return an error
+	if(res < 0)
+		return res;
+	else;
+
+	handle = malloc(sizeof(cs1550_file_handle));
+	if(handle == NULL)
+	{
+		unlockDirectory(slot);
+		return -ENOMEM;
+	}
+	else;
+	handle->slot = slot;
+	handle->index = index;
+	strcpy(handle->fname, fs.directories.entries[slot].files[index].fname);
+	strcpy(handle->fext, fs.directories.entries[slot].files[index].fext);
+	handle->generation = fs.directories.maps[slot * MAX_FILES_IN_DIR + index].generation;
+	unlockDirectory(slot);
+	pthread_mutex_init(&handle->lock, NULL);
+	handle->dirty = 0;
+	handle->nextOffset = 0;
+	handle->window = 0;
+	handle->readAheadEnd = 0;
+	handle->stats = NULL;
+	handle->statsSize = 0;
+	handle->released = NULL;
+	handle->nReleased = 0;
+	handle->releasedCapacity = 0;
+	handle->writtenFrom = 0;
+	handle->writtenTo = 0;
+	*file = handle;
+	__sync_fetch_and_add(&fs.openFiles, 1);
+
+	return 0; //success!
+}
+
+// Writes the blocks of a handle's file that changed through it since its
+// last flush from the block cache to .disk, with all of its extent blocks.
+// Extents that follow each other on disk go together. Other files' blocks
+// stay in the cache until they are flushed themselves or evicted. With
+// -o mmap there is no cache and the same pages get msync with flags instead.
+static int writeBackHandle(cs1550_file_handle *handle, int flags)
+{
+	cs1550_extent_map *map;
+	long from;
+	long to;
+	long start = 0;
+	long count = 0;
+	long k;
+	int slot;
+	int i;
+	int res = 0;
+
+	pthread_mutex_lock(&handle->lock);
+	from = handle->writtenFrom;
+	to = handle->writtenTo;
+	handle->writtenFrom = 0;
+	handle->writtenTo = 0;
+	pthread_mutex_unlock(&handle->lock);
+	if(fs.cache.nEntries == 0 && fs.diskMap == NULL)
+		return 0;
+	else if(lockHandle(handle, &slot, &i) < 0) // removed while it was open, its blocks went with it
+		return 0;
+	else;
+	pthread_rwlock_rdlock(fileLock(slot, i));
+	map = &fs.directories.maps[slot * MAX_FILES_IN_DIR + i];
+	if(!map->loaded)
+		k = map->nExtents + map->nExtentBlocks;
+	else if(from < to && from < map->nBlocks)
+		k = findExtent(map, from);
+	else
+		k = map->nExtents;
+	for(; map->loaded && k <= map->nExtents + map->nExtentBlocks && res == 0; k++)
+	{
+		long next = 0;
+		long n = 0;
+		if(k < map->nExtents && map->fileBlocks[k] >= to)
+			k = map->nExtents;
+		else;
+		if(k < map->nExtents && map->extents[k].nBlocks < 0)
+		{
+			next = map->extents[k].nStartBlock;
+			n = diskBlocksOf(&map->extents[k]);
+		}
+		else if(k < map->nExtents && !isHole(&map->extents[k]))
+		{
+			//only the part of a plain extent that was written
+			long first = map->fileBlocks[k] > from ? map->fileBlocks[k] : from;
+			long end = map->fileBlocks[k] + map->extents[k].nBlocks < to ? map->fileBlocks[k] + map->extents[k].nBlocks : to;
+			next = map->extents[k].nStartBlock + first - map->fileBlocks[k];
+			n = end - first;
+		}
+		else if(k >= map->nExtents && k < map->nExtents + map->nExtentBlocks)
+		{
+			next = map->extentBlocks[k - map->nExtents];
+			n = 1;
+		}
+		else if(k < map->nExtents) // a hole
+			continue;
+		else;
+		if(n > 0 && count > 0 && next == start + count)
+		{
+			count += n;
+			continue;
+		}
+		else;
+		if(count > 0 && fs.diskMap != NULL)
+			res = syncMapped(start, count, flags);
+		else if(count > 0)
+			res = writeBackBlocks(start, count);
+		else;
+		start = next;
+		count = n;
+	}
+	pthread_rwlock_unlock(fileLock(slot, i));
+	unlockDirectory(slot);
+	//what couldn't be written is tried again at the next flush
+	if(res < 0)
+		markWritten(handle, from, to);
+	else;
+	return res;
+}
+
+/*
+ * Deduplicates and compresses what was written with -o dedup and -o compress,
+ * writes the file's blocks back from the block cache, or msyncs their pages
+ * with flags under -o mmap, then logs the file's directory record in the
+ * journal if a write changed it, so the record never covers data that isn't
+ * on disk. The journal commits it shortly after; syncHandle waits for that.
+ */
+static int flushHandle(cs1550_file_handle *handle, int flags)
+{
+	cs1550_extent *released;
+	long nReleased;
+	long capacity;
+	long k;
+	int dirty;
+	long sequence;
+	int packed = 0;
+	int res = 0;
+
+	if(handle->stats != NULL) //nothing to write back
+		return 0;
+	else;
+	if(options.compress || options.dedup)
+		packed = packHandle(handle);
+	else;
+	if(writeBackHandle(handle, flags) < 0)
+		return -EIO;
+	else;
+
+	//blocks the file stopped using can be reused once what replaced them is
+	//written back, unless the extent list that no longer has them couldn't
+	//be saved. The next flush tries again.
+	if(packed == 0)
+	{
+		pthread_mutex_lock(&handle->lock);
+		released = handle->released;
+		nReleased = handle->nReleased;
+		capacity = handle->releasedCapacity;
+		handle->released = NULL;
+		handle->nReleased = 0;
+		handle->releasedCapacity = 0;
+		pthread_mutex_unlock(&handle->lock);
+		for(k = 0; k < nReleased; k++)
+			freeBlocks(released[k].nStartBlock, released[k].nBlocks);
+		//the array is kept for the next runs unless a write started another
+		pthread_mutex_lock(&handle->lock);
+		if(handle->released == NULL)
+		{
+			handle->released = released;
+			handle->releasedCapacity = capacity;
+			released = NULL;
+		}
+		else;
+		pthread_mutex_unlock(&handle->lock);
+		free(released);
+	}
+	else;
+
+	pthread_mutex_lock(&handle->lock);
+	dirty = handle->dirty;
+	handle->dirty = 0;
+	pthread_mutex_unlock(&handle->lock);
+	if(dirty)
+	{
+		lockDirectory(handle->slot, 0);
+		sequence = logDirectory(handle->slot);
+		unlockDirectory(handle->slot);
+		res = sequence < 0 ? sequence : 0;
+	}
+	else;
+	return res < 0 ? res : packed;
+}
+
+/*
+ * Flushes the file and frees the handle made in openFile.
+ */
+static int closeHandle(cs1550_file_handle *handle)
+{
+	int res = flushHandle(handle, MS_ASYNC);
+
+	pthread_mutex_destroy(&handle->lock);
+	free(handle->stats);
+	free(handle->released);
+	free(handle);
+	//with nothing open the reserved blocks go back to the bitmap
+	if(__sync_sub_and_fetch(&fs.openFiles, 1) == 0)
+		returnPools();
+	else;
+	return res;
+}
+
+/*
+ * Does what flush does, waits for the journal to commit the file's record
+ * and then saves the free space bitmap and makes sure all of it has reached
+ * the backing files. With -o mmap only the file's pages get MS_SYNC rather
+ * than the whole mapping; the fsync writes back the bitmap's pages with
+ * everything else in .disk's page cache.
+ */
+static int syncHandle(cs1550_file_handle *handle)
+{
+	int res = flushHandle(handle, MS_SYNC);
+
+	if(res == 0)
+		res = syncJournal();
+	else;
+	if(res == 0)
+		res = saveAllocator(0);
+	else;
+	if(res == 0 && (fsync(fs.diskFd) < 0 || fsync(fs.directoriesFd) < 0))
+		res = -EIO;
+	else if(res == 0)
+	{
+		countSync(&fs.stats.disk);
+		countSync(&fs.stats.directories);
+	}
+	else;
+	return res;
+}
+
+//Counts a finished operation in fs.stats and returns its result. The latency
+//goes in the bucket for the first power of two microseconds above it.
+static int opEnd(int op, long start, int res)
+{
+	cs1550_op_stats *stats = &fs.stats.ops[op];
+	unsigned long elapsed = opStart() - start;
+	long micros = elapsed / 1000;
+	int bucket = 0;
+
+	while(bucket < LATENCY_BUCKETS - 1 && micros >= (1L << bucket))
+		bucket++;
+	__sync_fetch_and_add(&stats->calls, 1);
+	if(res < 0)
+		__sync_fetch_and_add(&stats->errors, 1);
+	else;
+	__sync_fetch_and_add(&stats->nanoseconds, elapsed);
+	__sync_fetch_and_add(&stats->latency[bucket], 1);
+	return res;
+}
+
+//The API in cs1550_engine.h, timed for CS1550_STATS_PATH
+int cs1550_info(cs1550_image_info *info)
+{
+	info->blockSize = fs.blockSize;
+	info->nBlocks = fs.nBlocks;
+	pthread_mutex_lock(&fs.allocatorLock);
+	info->freeBlocks = fs.allocator.nFree;
+	pthread_mutex_unlock(&fs.allocatorLock);
+	info->filesPerDirectory = 0;
+	return 0;
+}
+
+int cs1550_lookup(const char *path, struct stat *st)
+{
+	long start = opStart();
+	return opEnd(OP_LOOKUP, start, getAttributes(path, st));
+}
+
+int cs1550_list(const char *path, cs1550_list_fn fn, void *arg)
+{
+	long start = opStart();
+	return opEnd(OP_LIST, start, listDirectory(path, fn, arg));
+}
+
+int cs1550_make_directory(const char *path)
+{
+	long start = opStart();
+	return opEnd(OP_MKDIR, start, makeDirectory(path));
+}
+
+int cs1550_create(const char *path)
+{
+	long start = opStart();
+	return opEnd(OP_CREATE, start, createFile(path));
+}
+
+int cs1550_remove(const char *path)
+{
+	long start = opStart();
+	return opEnd(OP_REMOVE, start, removeFile(path));
+}
+
+int cs1550_open_file(const char *path, int flags, cs1550_file **file)
+{
+	long start = opStart();
+	return opEnd(OP_OPEN, start, openFile(path, flags, file));
+}
+
+int cs1550_read_file(cs1550_file *file, char *buf, size_t size, off_t offset)
+{
+	long start = opStart();
+	return opEnd(OP_READ, start, readHandle(file, buf, size, offset));
+}
+
+int cs1550_write_file(cs1550_file *file, const char *buf, size_t size, off_t offset)
+{
+	long start = opStart();
+	return opEnd(OP_WRITE, start, writeHandle(file, buf, size, offset));
+}
+
+int cs1550_truncate_file(const char *path, off_t size)
+{
+	long start = opStart();
+	cs1550_file_handle *handle;
+	int res = openFile(path, O_WRONLY, &handle);
+
+	//the handle's flush writes the record and frees the blocks cut off
+	if(res == 0)
+	{
+		res = truncateHandle(handle, size);
+		if(closeHandle(handle) < 0 && res == 0)
+			res = -EIO;
+		else;
+	}
+	else;
+	return opEnd(OP_TRUNCATE, start, res);
+}
+
+int cs1550_flush_file(cs1550_file *file)
+{
+	long start = opStart();
+	return opEnd(OP_FLUSH, start, flushHandle(file, MS_ASYNC));
+}
+
+int cs1550_close_file(cs1550_file *file)
+{
+	long start = opStart();
+	return opEnd(OP_CLOSE, start, closeHandle(file));
+}
+
+int cs1550_sync_file(cs1550_file *file)
+{
+	long start = opStart();
+	return opEnd(OP_SYNC, start, syncHandle(file));
+}
+
+char *cs1550_read_stats(long *size)
+{
+	return renderStats(size);
+}
@@ -0,0 +1,125 @@
+/*
+	The cs1550 storage engine. Everything that reads and writes an image,
+	the .disk and .directories files in one directory, without FUSE. cs1550.c
+	puts it under a FUSE mount; anything else can link libcs1550.a and call
+	it directly, with no kernel round trips.
+
+	One image is open in a process at a time. Once it is open every call
+	here may be made from several threads at once. Paths are the ones the
+	mount would show: "/dir/sub" for a directory, nested as deep as wanted,
+	and "/dir/sub/name.ext" for a file. Files can't be made in the root.
+	Calls that can fail return a negative errno value.
+
+	With compress set, whole 64 KB pieces of a file are compressed when the
+	file is flushed, and decompressed again when they are read. Files whose
+	extension says they are compressed already, such as gz, zip, jpg or mp4,
+	and every file in a directory holding a file called "nocomp" are left
+	as they are. Compressed data is read back whether compress is set or not.
+
+	With dedup set, each whole block written to a file is compared, when the
+	file is flushed, with the blocks written before it since the image was
+	opened, and one holding the same data is used in its place, so files
+	copied from one another share their blocks. Writing to a shared block
+	gives the file a copy of its own first. An image with shared blocks
+	keeps track of them whether dedup is set or not.
+
+	Unless checksums is cleared, every block of file data and metadata has a
+	CRC32C that is checked when the block is read from .disk, and a read of
+	a block that doesn't match fails with -EIO. A thread also reads the
+	disk through slowly in the background, scrubKB KB a second, to find
+	blocks that went bad before anyone reads them. Both count in the
+	"checksums:" line of CS1550_STATS_PATH.
+*/
+
+#ifndef CS1550_ENGINE_H
+#define CS1550_ENGINE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+//The read-only file at the root that shows the engine's statistics. Like the
+//files in /proc its size is 0, its text is made when it is opened.
+#define CS1550_STATS_PATH "/.stats"
+
+//How an image is opened. FUSE fills these in from -o cache_kb=N,
+//-o block_size=N, -o mmap, -o compress, -o dedup, -o nochecksums and
+//-o scrub_kb=N.
+struct cs1550_options
+{
+	unsigned long cacheKB;		//memory for the block cache in KB, 0 turns it off
+	unsigned long blockSize;	//block size for a disk that is formatted when it is opened, 4 KB to 64 KB
+	int useMmap;			//map .disk into memory instead of using the block cache
+	int compress;			//compress file data when it is flushed, see below
+	int dedup;			//share blocks holding the same data, see below
+	int checksums;			//keep a checksum of every block, see below
+	unsigned long scrubKB;		//how fast the background scrub reads, 0 turns it off
+};
+
+typedef struct cs1550_options cs1550_options;
+
+//What cs1550_open_image uses when it is given no options
+#define CS1550_DEFAULT_OPTIONS { 1024, 4096, 0, 0, 0, 1, 1024 }
+
+//The shape of the open image, from cs1550_info
+struct cs1550_image_info
+{
+	long blockSize;
+	long nBlocks;
+	long freeBlocks;
+	int filesPerDirectory;		//most files one directory can hold, 0 if there is no limit
+};
+
+typedef struct cs1550_image_info cs1550_image_info;
+
+//A file opened with cs1550_open_file
+typedef struct cs1550_file_handle cs1550_file;
+
+//Called by cs1550_list once for every name in a directory. Returning
+//nonzero stops the listing.
+typedef int (*cs1550_list_fn)(void *arg, const char *name);
+
+//Opens the image in directory, or in the current directory if it is NULL.
+//.disk has to exist already; a .disk nothing has been written to is
+//formatted. options may be NULL for CS1550_DEFAULT_OPTIONS.
+int cs1550_open_image(const char *directory, const cs1550_options *options);
+
+//Writes everything back and closes the image. Files still open are lost.
+void cs1550_close_image(void);
+
+int cs1550_info(cs1550_image_info *info);
+
+//Fills in the type and size of whatever path names, or returns -ENOENT
+int cs1550_lookup(const char *path, struct stat *st);
+
+int cs1550_list(const char *path, cs1550_list_fn fn, void *arg);
+int cs1550_make_directory(const char *path);
+int cs1550_create(const char *path);
+int cs1550_remove(const char *path);
+
+//flags are the O_ flags of open(2); only the access mode matters
+int cs1550_open_file(const char *path, int flags, cs1550_file **file);
+
+//Return how many bytes were read or written. A write may start past the end
+//of the file; what it skips over is a hole, which reads as zeros and takes
+//no space until something is written there.
+int cs1550_read_file(cs1550_file *file, char *buf, size_t size, off_t offset);
+int cs1550_write_file(cs1550_file *file, const char *buf, size_t size, off_t offset);
+
+//Makes a file size bytes long. Growing it adds a hole; shrinking it frees
+//the blocks past the new end.
+int cs1550_truncate_file(const char *path, off_t size);
+
+//Flushing writes the file's data back and logs its new size; syncing also
+//waits until both are on stable storage
+int cs1550_flush_file(cs1550_file *file);
+int cs1550_sync_file(cs1550_file *file);
+
+//Flushes the file and frees it
+int cs1550_close_file(cs1550_file *file);
+
+//Returns the text of CS1550_STATS_PATH, which the caller frees, and stores
+//its length in *size. NULL if there was no memory.
+char *cs1550_read_stats(long *size);
+
+#endif